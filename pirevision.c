@@ -16,11 +16,32 @@
  * You should have received a copy of the GNU General Public License along with
  * this program. If not, see <https://www.gnu.org/licenses/>
  */
+#ifdef __linux__
+#define _GNU_SOURCE             // For vmsplice() and pipe sizing
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#ifdef PIREVISION_ZLIB
+#include <zlib.h>
+#endif
 
 typedef unsigned int revcode_32;
 
@@ -60,16 +81,325 @@ typedef unsigned int revcode_32;
 
 #define OLD_REV_NOT_VALID 0xFFFFFFFF
 
+/*
+ * Lookup tables used for decoding.
+ *
+ * The built-in tables below can be replaced at run time by tables compiled
+ * (with --compile-tables) into a binary file, which is memory mapped and
+ * used in place, so adding a board does not require a new build. All
+ * lookups go through reader_tables().
+ */
+const char *type_map[] = {
+    "A",
+    "B",
+    "A+",
+    "B+",
+    "2B",
+    "Alpha",
+    "CM1",
+    "0x07",
+    "3B",
+    "Zero",
+    "CM3",
+    "0x0B",
+    "Zero W",
+    "3B+",
+    "3A+",
+    "Internal use only",
+    "CM3+",
+    "4B",
+    "Zero 2 W",
+    "400",
+    "CM4",
+    "CM4S",
+    /* Lots of room for future: 256 entries */
+};
+
+const char *processor_map[] = {
+    "BCM2835", /* 0 */
+    "BCM2836", /* 1 */
+    "BCM2837", /* 2 */
+    "BCM2711", /* 3 */
+    /* Entries 4-15  still available for future use */
+};
+
+// 1GB is 0x4000_0000 (fits 32 bits)
+// 2GB is 0x8000_0000 (fits 32 bits)
+// 8GB is 0x1_0000_0000 does not fit 32 bits)
+// Therefore we return in units of MB which removes the need for the last
+// 20 bits, making this fit (8GB = 8192MB = 0x2000).
+// We have to care because on 32-bit systems (Raspberry) this long is the
+// same size as int, which is 32-bits and the 8GB entry would overflow.
+const uint32_t mem_mbytes_map[] = {
+         256, /* 0 */
+         512, /* 1 */
+    1 * 1024, /* 2 */
+    2 * 1024, /* 3 */
+    4 * 1024, /* 4 */
+    8 * 1024, /* 5 */
+    /* 6 and 7 still available for future use */
+};
+
+const char *manufacturer_map[] = {
+    "Sony UK",      /* 0 */
+    "Egoman",       /* 1 */
+    "Embest",       /* 2 */
+    "Sony Japan",   /* 3 */
+    "Embest",       /* 4 */
+    "Stadium",      /* 5 */
+    /* Entries 6-14  still available for future use */
+    /* Index 15 used by this program for special purpose so a problem
+     * will arise if Raspberry starts to use that index.
+     */
+};
+
+const char *revision_map[] = {
+    "1.0", /* 0 */
+    "1.1", /* 1 */
+    "1.2", /* 2 */
+    "1.3", /* 3 */
+    "1.4", /* 4 */
+    "1.5", /* 5 */
+    /* Entries 6-14  still available for future use */
+    /* Index 15 used by this program for special purpose so a problem
+     * will arise if Raspberry starts to use that index.
+     */
+};
+
+/*
+ * New style equivalents of the old style revision codes, indexed by code.
+ */
+const revcode_32 old_revision_map[] = {
+    /* 0000 */  OLD_REV_NOT_VALID,
+    /* 0001 */  OLD_REV_NOT_VALID,
+    /* 0002 */  MODEL_B | REV_1_0 | MEM_256M | EGOMAN,
+    /* 0003 */  MODEL_B | REV_1_0 | MEM_256M | EGOMAN,
+    /* 0004 */  MODEL_B | REV_2_0 | MEM_256M | SONY_UK,
+    /* 0005 */  MODEL_B | REV_2_0 | MEM_256M | QISDA,
+    /* 0006 */  MODEL_B | REV_2_0 | MEM_256M | EGOMAN,
+    /* 0007 */  MODEL_A | REV_2_0 | MEM_256M | EGOMAN,
+    /* 0008 */  MODEL_A | REV_2_0 | MEM_256M | SONY_UK,
+    /* 0009 */  MODEL_A | REV_2_0 | MEM_256M | QISDA,
+    /* 000a */  OLD_REV_NOT_VALID,
+    /* 000b */  OLD_REV_NOT_VALID,
+    /* 000c */  OLD_REV_NOT_VALID,
+    /* 000d */  MODEL_B | REV_2_0 | MEM_512M | EGOMAN,
+    /* 000e */  MODEL_B | REV_2_0 | MEM_512M | SONY_UK,
+    /* 000f */  MODEL_B | REV_2_0 | MEM_512M | EGOMAN,
+    /* 0010 */  MODEL_BPLUS | REV_1_2 | MEM_512M | SONY_UK,
+    /* 0011 */  MODEL_CM1 | REV_1_0 | MEM_512M | SONY_UK,
+    /* 0012 */  MODEL_APLUS | REV_1_1 | MEM_256M | SONY_UK,
+    /* 0013 */  MODEL_BPLUS | REV_1_2 | MEM_512M | EMBEST,
+    /* 0014 */  MODEL_CM1 | REV_1_0 | MEM_512M | EMBEST,
+    // This next model comes with 256MB or 512MB, so under report is our
+    // effort because we have to choose just one (there are not separate
+    // old style revision codes for this!
+    /* 0015 */  MODEL_APLUS | REV_1_1 | MEM_256M | EMBEST,
+};
+
+typedef enum {
+    TABLE_TYPE,
+    TABLE_PROCESSOR,
+    TABLE_MEMORY,
+    TABLE_MANUFACTURER,
+    TABLE_REVISION,
+    TABLE_OLD_REVISION,
+    TABLE_COUNT
+} table_id;
+
+typedef struct {
+    const char *name;           // Name used in table specifications
+    int strings;                // Whether entries are strings, or numbers
+    uint32_t max_count;         // Number of possible indexes
+} table_info;
+
+const table_info table_infos[TABLE_COUNT] = {
+    { "type", 1, 256 },
+    { "processor", 1, 16 },
+    { "memory", 0, 8 },
+    { "manufacturer", 1, 16 },
+    { "revision", 1, 16 },
+    { "old", 0, 4096 },
+};
+
+typedef struct {
+    // Start of a compiled table file, to which string entries are offsets,
+    // or NULL if string entries are pointers (built-in tables)
+    const char *base;
+    size_t size;                // Size of the compiled table file
+    uint32_t counts[TABLE_COUNT];
+    const void *entries[TABLE_COUNT];
+} lookup_tables;
+
+const lookup_tables builtin_tables = {
+    NULL,
+    0,
+    {
+        ARRAY_CNT(type_map),
+        ARRAY_CNT(processor_map),
+        ARRAY_CNT(mem_mbytes_map),
+        ARRAY_CNT(manufacturer_map),
+        ARRAY_CNT(revision_map),
+        ARRAY_CNT(old_revision_map),
+    },
+    {
+        type_map,
+        processor_map,
+        mem_mbytes_map,
+        manufacturer_map,
+        revision_map,
+        old_revision_map,
+    },
+};
+
+/*
+ * The tables in use can be replaced while decoding (see tables_reloader_main),
+ * without readers taking locks. Each reading thread uses the tables it
+ * found on coming online (current_tables) until it next goes offline,
+ * which it does around blocking reads and writes, when it holds no pointers
+ * into the tables (table strings are copied when rendered, see
+ * render_table_str()). Replaced tables are released once every online
+ * reader has come online again since the replacement (epoch based
+ * reclamation). A reader's slot is released when its thread exits.
+ */
+#define MAX_TABLE_READERS 64
+
+_Atomic(const lookup_tables *) active_tables = &builtin_tables;
+_Atomic unsigned long tables_epoch = 1;
+// Epoch at which each reader came online, 0 while offline
+_Atomic unsigned long reader_epochs[MAX_TABLE_READERS];
+_Atomic int reader_slots_used[MAX_TABLE_READERS];
+// Readers beyond MAX_TABLE_READERS, which could be using any tables
+_Atomic int untracked_readers;
+pthread_key_t reader_key;
+pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+_Thread_local int reader_slot = -1;
+_Thread_local const lookup_tables *current_tables;
+_Thread_local int tables_pinned;
+
+/**
+ * Release the reader slot of an exiting thread.
+ */
+void
+reader_exit(void *slot_value)
+{
+    const int slot = (int) (intptr_t) slot_value - 1;
+    if (slot < MAX_TABLE_READERS) {
+        atomic_store(&reader_epochs[slot], 0);
+        atomic_store(&reader_slots_used[slot], 0);
+    }
+    else {
+        atomic_fetch_sub(&untracked_readers, 1);
+    }
+}
+
+void
+reader_key_create(void)
+{
+    pthread_key_create(&reader_key, reader_exit);
+}
+
+/**
+ * Start using the tables in use, registering the thread as a reader if
+ * needed.
+ */
+void
+tables_online(void)
+{
+    if (reader_slot < 0) {
+        pthread_once(&reader_key_once, reader_key_create);
+        for (reader_slot = 0; reader_slot < MAX_TABLE_READERS; ++reader_slot) {
+            int unused = 0;
+            if (atomic_compare_exchange_strong(&reader_slots_used[reader_slot],
+                                               &unused, 1)) {
+                break;
+            }
+        }
+        if (reader_slot == MAX_TABLE_READERS) {
+            atomic_fetch_add(&untracked_readers, 1);
+        }
+        pthread_setspecific(reader_key, (void *) (intptr_t) (reader_slot + 1));
+    }
+    if (reader_slot < MAX_TABLE_READERS) {
+        // Publish the epoch before picking up the tables
+        atomic_store(&reader_epochs[reader_slot], atomic_load(&tables_epoch));
+    }
+    current_tables = atomic_load(&active_tables);
+}
+
+/**
+ * Stop using the tables, which may then be replaced and released.
+ */
+void
+tables_offline(void)
+{
+    current_tables = NULL;
+    if ((reader_slot >= 0) && (reader_slot < MAX_TABLE_READERS)) {
+        atomic_store_explicit(&reader_epochs[reader_slot], 0, memory_order_release);
+    }
+}
+
+/**
+ * Go offline for a blocking operation, unless the thread is not online or
+ * holds on to the tables (see tables_pin()).
+ *
+ * @returns Whether to come online again with tables_resume()
+ */
+int
+tables_pause(void)
+{
+    if ((current_tables == NULL) || (tables_pinned > 0)) {
+        return 0;
+    }
+    tables_offline();
+    return 1;
+}
+
+void
+tables_resume(const int paused)
+{
+    if (paused) {
+        tables_online();
+    }
+}
+
+/**
+ * Keep using the current tables across blocking output, for output that
+ * must come from a single version of the tables.
+ */
+void
+tables_pin(void)
+{
+    tables_pinned++;
+}
+
+void
+tables_unpin(void)
+{
+    tables_pinned--;
+}
+
+/**
+ * The tables to use for lookups by this thread.
+ */
+const lookup_tables *
+reader_tables(void)
+{
+    return (current_tables != NULL)
+           ? current_tables
+           : atomic_load_explicit(&active_tables, memory_order_acquire);
+}
+
 /**
- * Return the entry from a lookup table, indexed as specified.
+ * Return the string entry from a lookup table, indexed as specified.
  *
  * The index is checked against the count and if valid, the lookup result will
  * be returned. If the index is out of bounds and a `invalid_index_str` is
  * specified, AND if the index is equal to the `invalid_index` than this
  * substitute string is returned. Otherwise "???" is returned.
  *
- * @param lut The lookup table (const char *array[])
- * @param lut_count Number of entries in lut
+ * @param table The lookup table
  * @param index Index for lookup
  * @param invalid_index Index which, if given, is considered invalid and will
  *                      cause the substitute string to be used (if not NULL)
@@ -79,14 +409,17 @@ typedef unsigned int revcode_32;
  * @returns String from table, substitute invalid string, or "???"
  */
 const char *
-lut_to_str_with_invalid(const char *lut[],
-                        const int lut_count,
-                        const int index,
-                        const int invalid_index,
-                        const char *invalid_index_str)
+table_str(const table_id table,
+          const unsigned int index,
+          const unsigned int invalid_index,
+          const char *invalid_index_str)
 {
-    if (index < lut_count) {
-        return lut[index];
+    const lookup_tables *tables = reader_tables();
+    if (index < tables->counts[table]) {
+        if (tables->base != NULL) {
+            return tables->base + ((const uint32_t *) tables->entries[table])[index];
+        }
+        return ((const char *const *) tables->entries[table])[index];
     }
     if ((invalid_index_str != NULL) && (index == invalid_index)) {
         return invalid_index_str;
@@ -95,26 +428,22 @@ lut_to_str_with_invalid(const char *lut[],
 }
 
 /**
- * Return the entry from a lookup table, indexed as specified.
- *
- * The index is checked against the count and if valid, the lookup result will
- * be returned. Otherwise "???" is returned.
+ * Return the numeric entry from a lookup table, indexed as specified.
  *
- * @param lut   The lookup table (const char *array[])
- * @param lut_count Number of entries in lut
+ * @param table The lookup table
  * @param index Index for lookup
- * @returns String from table, or "???"
+ * @param missing Value returned if the index is out of bounds
+ * @returns Value from table, or missing
  */
-const char *
-lut_to_str(const char *lut[],
-           const int lut_count,
-           const int index)
+uint32_t
+table_value(const table_id table,
+            const unsigned int index,
+            const uint32_t missing)
 {
-    return lut_to_str_with_invalid(lut,
-                                   lut_count,
-                                   index,
-                                   0,
-                                   NULL); // No invalid substitution!
+    const lookup_tables *tables = reader_tables();
+    return (index < tables->counts[table])
+           ? ((const uint32_t *) tables->entries[table])[index]
+           : missing;
 }
 
 int
@@ -185,32 +514,7 @@ type_index(const revcode_32 revision_code)
 const char *
 type_str(const revcode_32 revision_code)
 {
-    static const char *type_map[] = {
-        "A",
-        "B",
-        "A+",
-        "B+",
-        "2B",
-        "Alpha",
-        "CM1",
-        "0x07",
-        "3B",
-        "Zero",
-        "CM3",
-        "0x0B",
-        "Zero W",
-        "3B+",
-        "3A+",
-        "Internal use only",
-        "CM3+",
-        "4B",
-        "Zero 2 W",
-        "400",
-        "CM4",
-        "CM4S",
-        /* Lots of room for future: 256 entries */
-    };
-    return lut_to_str(type_map, ARRAY_CNT(type_map), type_index(revision_code));
+    return table_str(TABLE_TYPE, type_index(revision_code), 0, NULL);
 }
 
 unsigned int
@@ -225,24 +529,7 @@ physical_memory_index(const revcode_32 revision_code)
 unsigned int
 physical_memory_mbytes(const revcode_32 revision_code)
 {
-    // 1GB is 0x4000_0000 (fits 32 bits)
-    // 2GB is 0x8000_0000 (fits 32 bits)
-    // 8GB is 0x1_0000_0000 does not fit 32 bits)
-    // Therefore we return in units of MB which removes the need for the last
-    // 20 bits, making this fit (8GB = 8192MB = 0x2000).
-    // We have to care because on 32-bit systems (Raspberry) this long is the
-    // same size as int, which is 32-bits and the 8GB entry would overflow.
-    static unsigned int mem_mbytes_map[] = {
-             256, /* 0 */
-             512, /* 1 */
-        1 * 1024, /* 2 */
-        2 * 1024, /* 3 */
-        4 * 1024, /* 4 */
-        8 * 1024, /* 5 */
-        /* 6 and 7 still available for future use */
-    };
-    const int index = physical_memory_index(revision_code);
-    return (index > ARRAY_CNT(mem_mbytes_map)) ? 0 : mem_mbytes_map[index];
+    return table_value(TABLE_MEMORY, physical_memory_index(revision_code), 0);
 }
 
 /**
@@ -305,16 +592,7 @@ processor_index(const revcode_32 revision_code)
 const char *
 processor_str(const revcode_32 revision_code)
 {
-    static const char *processor_map[] = {
-        "BCM2835", /* 0 */
-        "BCM2836", /* 1 */
-        "BCM2837", /* 2 */
-        "BCM2711", /* 3 */
-        /* Entries 4-15  still available for future use */
-    };
-    return lut_to_str(processor_map,
-                      ARRAY_CNT(processor_map),
-                      processor_index(revision_code));
+    return table_str(TABLE_PROCESSOR, processor_index(revision_code), 0, NULL);
 }
 
 unsigned int
@@ -326,24 +604,10 @@ manufacturer_index(const revcode_32 revision_code)
 const char *
 manufacturer_str(const revcode_32 revision_code)
 {
-    static const char *manufacturer_map[] = {
-        "Sony UK",      /* 0 */
-        "Egoman",       /* 1 */
-        "Embest",       /* 2 */
-        "Sony Japan",   /* 3 */
-        "Embest",       /* 4 */
-        "Stadium",      /* 5 */
-        /* Entries 6-14  still available for future use */
-        /* Index 15 used by this program for special purpose so a problem
-         * will arise if Raspberry starts to use that index.
-         */
-    };
-    const int index = manufacturer_index(revision_code);
-    return lut_to_str_with_invalid(manufacturer_map,
-                                   ARRAY_CNT(manufacturer_map),
-                                   index,
-                                   (QISDA >> 16),
-                                   "Qisda");
+    return table_str(TABLE_MANUFACTURER,
+                     manufacturer_index(revision_code),
+                     (QISDA >> 16),
+                     "Qisda");
 }
 
 unsigned int
@@ -355,271 +619,8664 @@ revision_index(const revcode_32 revision_code)
 const char *
 revision_str(const revcode_32 revision_code)
 {
-    static const char *revision_map[] = {
-        "1.0", /* 0 */
-        "1.1", /* 1 */
-        "1.2", /* 2 */
-        "1.3", /* 3 */
-        "1.4", /* 4 */
-        "1.5", /* 5 */
-        /* Entries 6-14  still available for future use */
-        /* Index 15 used by this program for special purpose so a problem
-         * will arise if Raspberry starts to use that index.
-         */
-    };
-    const int index = revision_index(revision_code);
-    return lut_to_str_with_invalid(revision_map,
-                                   ARRAY_CNT(revision_map),
-                                   index,
-                                   (REV_2_0 >> 0),
-                                   "2.0");
+    return table_str(TABLE_REVISION,
+                     revision_index(revision_code),
+                     (REV_2_0 >> 0),
+                     "2.0");
 }
 
-revcode_32
-map_old_to_new(const revcode_32 revision_code)
+/**
+ * Map a revision code to new style, without failing on invalid codes.
+ *
+ * Validity is returned separately, as any 32-bit value (including
+ * OLD_REV_NOT_VALID) is a valid new style code.
+ *
+ * @param revision_code The code to map
+ * @param normalized Receives the new style code
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE for an old style code without a
+ *          new style equivalent
+ */
+int
+normalize_revision(const revcode_32 revision_code, revcode_32 *normalized)
 {
+    if (revision_new_style(revision_code)) {
+        *normalized = revision_code;
+        return EXIT_SUCCESS;
+    }
     // Map old style revisions to new style
-    static int old_revision_map[] = {
-        /* 0000 */  OLD_REV_NOT_VALID,
-        /* 0001 */  OLD_REV_NOT_VALID,
-        /* 0002 */  MODEL_B | REV_1_0 | MEM_256M | EGOMAN,
-        /* 0003 */  MODEL_B | REV_1_0 | MEM_256M | EGOMAN,
-        /* 0004 */  MODEL_B | REV_2_0 | MEM_256M | SONY_UK,
-        /* 0005 */  MODEL_B | REV_2_0 | MEM_256M | QISDA,
-        /* 0006 */  MODEL_B | REV_2_0 | MEM_256M | EGOMAN,
-        /* 0007 */  MODEL_A | REV_2_0 | MEM_256M | EGOMAN,
-        /* 0008 */  MODEL_A | REV_2_0 | MEM_256M | SONY_UK,
-        /* 0009 */  MODEL_A | REV_2_0 | MEM_256M | QISDA,
-        /* 000a */  OLD_REV_NOT_VALID,
-        /* 000b */  OLD_REV_NOT_VALID,
-        /* 000c */  OLD_REV_NOT_VALID,
-        /* 000d */  MODEL_B | REV_2_0 | MEM_512M | EGOMAN,
-        /* 000e */  MODEL_B | REV_2_0 | MEM_512M | SONY_UK,
-        /* 000f */  MODEL_B | REV_2_0 | MEM_512M | EGOMAN,
-        /* 0010 */  MODEL_BPLUS | REV_1_2 | MEM_512M | SONY_UK,
-        /* 0011 */  MODEL_CM1 | REV_1_0 | MEM_512M | SONY_UK,
-        /* 0012 */  MODEL_APLUS | REV_1_1 | MEM_256M | SONY_UK,
-        /* 0013 */  MODEL_BPLUS | REV_1_2 | MEM_512M | EMBEST,
-        /* 0014 */  MODEL_CM1 | REV_1_0 | MEM_512M | EMBEST,
-        // This next model comes with 256MB or 512MB, so under report is our
-        // effort because we have to choose just one (there are not separate
-        // old style revision codes for this!
-        /* 0015 */  MODEL_APLUS | REV_1_1 | MEM_256M | EMBEST,
-    };
+    *normalized = table_value(TABLE_OLD_REVISION, revision_code, OLD_REV_NOT_VALID);
+    return (*normalized == OLD_REV_NOT_VALID) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-    revcode_32 new_revision_code = revision_code;
-    if (!revision_new_style(new_revision_code)) {
-        new_revision_code = (new_revision_code < ARRAY_CNT(old_revision_map))
-                    ? old_revision_map[new_revision_code]
-                    : OLD_REV_NOT_VALID;
-        if (new_revision_code == OLD_REV_NOT_VALID) {
-            fprintf(stderr, "Invalid old style revision!\n");
-            exit(EXIT_FAILURE);
-        }
+revcode_32
+map_old_to_new(const revcode_32 revision_code)
+{
+    revcode_32 new_revision_code;
+    if (normalize_revision(revision_code, &new_revision_code) != EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid old style revision!\n");
+        exit(EXIT_FAILURE);
     }
     return new_revision_code;
 }
 
-int
-print_revision_text(const revcode_32 revision_code)
-{
-    printf("Revision code 0x%0X interpreted:\n", revision_code);
-    const char *field_format = "    %-16s: %s\n";
+/*
+ * Packed descriptor of a decoded code: everything decoding yields, in 64
+ * bits, so it can be stored, sorted, hashed and compared cheaply. Fields
+ * are lookup table indexes of the normalized (new style) code:
+ *
+ *   bits  0-23  revision, type, processor, manufacturer and memory indexes
+ *               and the style bit, at the same positions as in the code
+ *   bits 24-27  flags: warranty voided, OTP reading disallowed, OTP
+ *               programming disallowed, overvoltage disallowed
+ *   bits 28-32  memory size exponent: memory is 1 << exponent MB
+ *               (0 if not known)
+ *   bits 40-47  error code (DESCRIPTOR_xxx)
+ *
+ * Other bits are 0.
+ */
+typedef uint64_t revision_descriptor;
+
+#define DESCRIPTOR_OK               0   // Valid code, all values known
+#define DESCRIPTOR_INVALID          1   // Old style code without equivalent
+#define DESCRIPTOR_UNKNOWN_VALUE    2   // A value is not in the lookup tables
+
+#define DESCRIPTOR_FIELDS_MASK      0xFFFFFF
+#define DESCRIPTOR_FLAGS_SHIFT      24
+#define DESCRIPTOR_MEMORY_SHIFT     28
+#define DESCRIPTOR_ERROR_SHIFT      40
 
-    revcode_32 code = map_old_to_new(revision_code);
-    int new_style = revision_new_style(code);
+/**
+ * Return the descriptor of a normalized (new style) code.
+ *
+ * @param normalized A valid code as returned by normalize_revision()
+ * @returns The descriptor
+ */
+revision_descriptor
+describe_normalized(const revcode_32 normalized)
+{
+    const lookup_tables *tables = reader_tables();
+    const unsigned int mega_bytes = physical_memory_mbytes(normalized);
+    unsigned int exponent = 0;
+    while ((mega_bytes >> exponent) > 1) {
+        ++exponent;
+    }
+    const int unknown
+        = (type_index(normalized) >= tables->counts[TABLE_TYPE])
+          || (revision_new_style(normalized)
+              && (processor_index(normalized) >= tables->counts[TABLE_PROCESSOR]))
+          || (mega_bytes == 0)
+          || ((manufacturer_index(normalized) >= tables->counts[TABLE_MANUFACTURER])
+              && (manufacturer_index(normalized) != (QISDA >> 16)))
+          || ((revision_index(normalized) >= tables->counts[TABLE_REVISION])
+              && (revision_index(normalized) != (REV_2_0 >> 0)));
+    const unsigned int flags = ((normalized >> 25) & 0x1)
+                               | (((normalized >> 29) & 0x7) << 1);
+    return (normalized & DESCRIPTOR_FIELDS_MASK)
+           | ((revision_descriptor) flags << DESCRIPTOR_FLAGS_SHIFT)
+           | ((revision_descriptor) (mega_bytes != 0 ? exponent : 0)
+              << DESCRIPTOR_MEMORY_SHIFT)
+           | ((revision_descriptor) (unknown ? DESCRIPTOR_UNKNOWN_VALUE
+                                             : DESCRIPTOR_OK)
+              << DESCRIPTOR_ERROR_SHIFT);
+}
 
-    printf(field_format, "Style", new_style ? "New" : "Old");
-    if (new_style) {
-        printf(field_format, "Overvoltage", overvoltage_allowed_str(code));
-        printf(field_format, "OTP Programming",
-               otp_programming_allowed_str(code));
-        printf(field_format, "OTP Reading", otp_reading_allowed_str(code));
-        printf(field_format, "Warranty", warranty_intact_str(code));
+revision_descriptor
+describe_revision(const revcode_32 revision_code)
+{
+    revcode_32 normalized;
+    if (normalize_revision(revision_code, &normalized) != EXIT_SUCCESS) {
+        return (revision_descriptor) DESCRIPTOR_INVALID << DESCRIPTOR_ERROR_SHIFT;
     }
+    return describe_normalized(normalized);
+}
 
-    printf(field_format, "Type/Model", type_str(code));
-    printf(field_format, "Revision", revision_str(code));
+unsigned int
+descriptor_error(const revision_descriptor descriptor)
+{
+    return (descriptor >> DESCRIPTOR_ERROR_SHIFT) & 0xFF;
+}
 
-    if (new_style) {
-        printf(field_format, "Processor/SOC", processor_str(code));
+/**
+ * Return the normalized code a descriptor was made from (except for any
+ * unused bits that were set in it). Not meaningful for a descriptor with
+ * error DESCRIPTOR_INVALID, for which 0 is returned.
+ */
+revcode_32
+descriptor_code(const revision_descriptor descriptor)
+{
+    if (descriptor_error(descriptor) == DESCRIPTOR_INVALID) {
+        return 0;
     }
+    const unsigned int flags = (descriptor >> DESCRIPTOR_FLAGS_SHIFT) & 0xF;
+    return (revcode_32) (descriptor & DESCRIPTOR_FIELDS_MASK)
+           | ((flags & 0x1) << 25) | ((revcode_32) (flags >> 1) << 29);
+}
 
-    char str[8];
-    printf(field_format, "Memory", physical_memory_str(code, str, sizeof(str)));
-    printf(field_format, "Manufacturer", manufacturer_str(code));
+unsigned int
+descriptor_type(const revision_descriptor descriptor)
+{
+    return type_index((revcode_32) descriptor);
+}
 
-    return EXIT_SUCCESS;
+unsigned int
+descriptor_processor(const revision_descriptor descriptor)
+{
+    return processor_index((revcode_32) descriptor);
 }
 
-const char *
-bool_json(const int value)
+unsigned int
+descriptor_manufacturer(const revision_descriptor descriptor)
 {
-    return value ? "true" : "false";
+    return manufacturer_index((revcode_32) descriptor);
+}
+
+unsigned int
+descriptor_revision(const revision_descriptor descriptor)
+{
+    return revision_index((revcode_32) descriptor);
+}
+
+unsigned int
+descriptor_memory_index(const revision_descriptor descriptor)
+{
+    return physical_memory_index((revcode_32) descriptor);
 }
 
 int
-print_revision_json(const revcode_32 revision_code)
+descriptor_new_style(const revision_descriptor descriptor)
 {
-    const char *field_format = "    %s: %s%s\n";
-    const char *str_field_format = "    %s: \"%s\"%s\n";
+    return revision_new_style((revcode_32) descriptor);
+}
 
-    revcode_32 code = map_old_to_new(revision_code);
-    int new_style = revision_new_style(code);
+unsigned int
+descriptor_flags(const revision_descriptor descriptor)
+{
+    return (descriptor >> DESCRIPTOR_FLAGS_SHIFT) & 0xF;
+}
 
-    printf("{\n");
-    char hex_revision[20];
-    sprintf(hex_revision, "0x%0X", revision_code);
-    printf(str_field_format, "revision_code", hex_revision, ",");
-    printf(str_field_format, "style", new_style ? "new" : "old", ",");
-    if (new_style) {
-        printf(field_format, "overvoltage_allowed",
-               bool_json(overvoltage_allowed(code)),
-               ",");
-        printf(field_format, "otp_programming_allowed",
-               bool_json(otp_programming_allowed(code)),
-               ",");
-        printf(field_format, "otp_reading_allowed",
-               bool_json(otp_reading_allowed(code)),
-               ",");
-        printf(field_format, "warranty_intact",
-               bool_json(warranty_intact(code)),
-               ",");
-    }
+/**
+ * Return physical amount of memory in MB, 0 if not known.
+ */
+unsigned int
+descriptor_memory_mbytes(const revision_descriptor descriptor)
+{
+    const unsigned int exponent = (descriptor >> DESCRIPTOR_MEMORY_SHIFT) & 0x1F;
+    return (exponent > 0) ? (1U << exponent) : 0;
+}
+
+/*
+ * Output is collected in a buffer and handed to the operating system in
+ * large blocks, instead of going through one printf() call per field.
+ *
+ * Optionally the writing is done by a separate writer thread, so decoding
+ * continues while output is being written: the buffer being filled is
+ * handed to the writer thread when full, and filling continues in another
+ * buffer. Filling only waits for the writer when all buffers are full.
+ *
+ * Also optionally, when the output is a pipe, full buffers are handed to
+ * the kernel with vmsplice() rather than copied with write(). The pipe is
+ * sized to hold exactly one (page aligned) buffer, so once a full buffer
+ * has been spliced into the pipe, all buffers spliced before it must have
+ * been consumed by the reader. Rotating through three buffers, and only
+ * flushing full buffers while output continues, then ensures a buffer is
+ * never refilled while the pipe still references its pages.
+ */
+#define OUT_BUFFER_SIZE (64 * 1024)
+#define OUT_SPLICE_SIZE (256 * 1024)
+#define OUT_MAX_BUFFERS 3
 
-    printf(str_field_format, "type", type_str(code), ",");
-    printf(str_field_format, "revision", revision_str(code), ",");
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signalled when pending or stop changes
+    const char *pending;        // Buffer to be written, NULL if none
+    size_t pending_used;        // Number of bytes in pending buffer
+    size_t splice_size;         // Size of buffers to splice, 0 if none
+    int stop;                   // Set to make the thread terminate
+    int failed;                 // Set once a write has failed
+    int fd;
+} async_writer;
 
-    if (new_style) {
-        printf(str_field_format, "processor", processor_str(code), ",");
-    }
+typedef struct {
+    int fd;                     // Descriptor receiving the output
+    int failed;                 // Set once a write has failed
+    size_t used;                // Number of bytes pending in data
+    size_t size;                // Size of data
+    char *data;                 // Buffer being filled
+    char *buffers[OUT_MAX_BUFFERS]; // Buffers to rotate through, if any
+    int buffer_count;
+    int current;                // Index of data in buffers
+    size_t splice_size;         // Size of buffers to splice, 0 if none
+    async_writer *writer;       // Writer thread, or NULL to write directly
+} out_buffer;
 
-    char str[8];
-    printf(str_field_format, "memory", physical_memory_str(code, str, sizeof(str)), ",");
-    printf(str_field_format, "manufacturer", manufacturer_str(code), "");
-    printf("}\n");
+char stdout_data[OUT_BUFFER_SIZE];
+out_buffer stdout_buffer = {
+    STDOUT_FILENO, 0, 0, sizeof(stdout_data), stdout_data,
+    { NULL }, 0, 0, 0, NULL
+};
+
+/**
+ * Write all data to a file descriptor, retrying after partial writes.
+ *
+ * @param fd File descriptor to write to
+ * @param data Data to be written
+ * @param length Number of bytes to write
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+write_all(const int fd, const char *data, const size_t length)
+{
+    size_t offset = 0;
+    while (offset < length) {
+        const ssize_t written = write(fd, data + offset, length - offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Could not write output: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        offset += (size_t) written;
+    }
     return EXIT_SUCCESS;
 }
 
-revcode_32
-str_to_revision(const char *input)
+/**
+ * Write a block of output, splicing it into the pipe if it is a full
+ * buffer and splicing is enabled.
+ *
+ * @param fd File descriptor to write to
+ * @param data Data to be written
+ * @param length Number of bytes to write
+ * @param splice_size Size of buffers to splice, or 0 to always write
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+write_block(const int fd,
+            const char *data,
+            const size_t length,
+            const size_t splice_size)
 {
-    errno = 0;
-    char *endptr;
-    // On 32-bit systems long might be same size as int, but that would still be
-    // 32-bits, which is enough for our purpose
-    unsigned long value = strtoul(input, &endptr, 16);
-    if (errno == ERANGE) {
-        fprintf(stderr, "Revision code \"%s\" too large or too small\n", input);
-        exit(EXIT_FAILURE);
-    }
-    if ((errno != 0) || (endptr == input)) {
-        fprintf(stderr, "Could not parse revision code \"%s\"\n", input);
-        exit(EXIT_FAILURE);
-    }
-    if ((sizeof(long) > sizeof(int)) && (value > 0xFFFFFFFF)) {
-        fprintf(stderr, "Revision code \"%s\" (%lx) larger than 32 bits\n",
-                input,
-                value);
-        exit(EXIT_FAILURE);
+#ifdef __linux__
+    if ((splice_size > 0) && (length == splice_size)) {
+        struct iovec iov;
+        iov.iov_base = (void *) data;
+        iov.iov_len = length;
+        while (iov.iov_len > 0) {
+            const ssize_t spliced = vmsplice(fd, &iov, 1, 0);
+            if (spliced < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Not spliceable after all, copy the remainder
+                return write_all(fd, iov.iov_base, iov.iov_len);
+            }
+            iov.iov_base = (char *) iov.iov_base + spliced;
+            iov.iov_len -= (size_t) spliced;
+        }
+        return EXIT_SUCCESS;
     }
-    return (revcode_32) value;
+#else
+    (void) splice_size;
+#endif
+    return write_all(fd, data, length);
 }
 
-int
-process_rev_codes(const char **codes,
-                  const int code_count,
-                  const int print_json)
+void *
+async_writer_main(void *arg)
 {
-    char rev_code_str[32] = { '\0' };
-    int exit_status = EXIT_SUCCESS;
+    async_writer *writer = arg;
 
-    // Process all extra args as revision codes
-    for (int index = 0;
-         index < code_count && (exit_status == 0); ++index) {
-        rev_code_str[0] = '\0';
-        strncpy(rev_code_str, codes[index], sizeof(rev_code_str) - 1);
-        rev_code_str[sizeof(rev_code_str) - 1] = '\0';
-        revcode_32 revision_code = str_to_revision(rev_code_str);
-        if (print_json) {
-            exit_status = print_revision_json(revision_code);
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while ((writer->pending == NULL) && !writer->stop) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
         }
-        else {
-            exit_status = print_revision_text(revision_code);
+        if (writer->pending == NULL) {
+            break;              // Stopped, and nothing left to write
         }
+        const char *data = writer->pending;
+        const size_t length = writer->pending_used;
+        const int failed = writer->failed;
+        pthread_mutex_unlock(&writer->lock);
+
+        const int status = failed ? EXIT_FAILURE
+                                  : write_block(writer->fd, data, length,
+                                                writer->splice_size);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->failed |= (status != EXIT_SUCCESS);
+        writer->pending = NULL;
+        pthread_cond_broadcast(&writer->changed);
     }
-    return exit_status;
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
 }
 
+/**
+ * Wait until the writer thread has written everything handed to it.
+ *
+ * @returns Whether any write failed
+ */
 int
-read_proc_cpuinfo(char *buffer, const size_t buffer_size)
+async_writer_wait(async_writer *writer)
 {
-    if (buffer_size <= 0) {
-        return EXIT_FAILURE;
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending != NULL) {
+        pthread_cond_wait(&writer->changed, &writer->lock);
     }
+    const int failed = writer->failed;
+    pthread_mutex_unlock(&writer->lock);
+    return failed;
+}
 
-    const char *cpuinfo = "/proc/cpuinfo";
-    FILE *fp = fopen(cpuinfo, "rt");
+/**
+ * Give an output buffer a set of buffers to rotate through.
+ *
+ * @param out The output buffer, which must be empty
+ * @param count Number of buffers
+ * @param size Size of each buffer
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+out_allocate_buffers(out_buffer *out, const int count, const size_t size)
+{
+    const long page_size = sysconf(_SC_PAGESIZE);
+    char *buffers[OUT_MAX_BUFFERS];
+    for (int index = 0; index < count; ++index) {
+        void *buffer = NULL;
+        if (posix_memalign(&buffer,
+                           (page_size > 0) ? (size_t) page_size : 4096,
+                           size) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            while (index > 0) {
+                free(buffers[--index]);
+            }
+            return EXIT_FAILURE;
+        }
+        buffers[index] = buffer;
+    }
+    for (int index = 0; index < out->buffer_count; ++index) {
+        free(out->buffers[index]);
+    }
+    memcpy(out->buffers, buffers, sizeof(buffers[0]) * (size_t) count);
+    out->buffer_count = count;
+    out->current = 0;
+    out->size = size;
+    out->data = out->buffers[0];
+    return EXIT_SUCCESS;
+}
 
-    if (fp == NULL) {
-        fprintf(stderr, "Could not open %s\n", cpuinfo);
+/**
+ * Make an output buffer write through a writer thread of its own.
+ *
+ * @param out The output buffer, which must be empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+out_start_async(out_buffer *out)
+{
+    if ((out->buffer_count < 2)
+        && (out_allocate_buffers(out, 2, out->size) != EXIT_SUCCESS)) {
         return EXIT_FAILURE;
     }
-
-    char line[256];
-    char format[32];// Creating limiting format to avoid buffer overflow
-
-    snprintf(format,
-             sizeof(format), "Revision : %%%ds",
-             (int)(buffer_size - 1));
-
-    buffer[0] = '\0';
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        if (sscanf(line, format, buffer) == 1)
-           break;
+    async_writer *writer = calloc(1, sizeof(async_writer));
+    if (writer == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
     }
-    fclose(fp);
+    writer->fd = out->fd;
+    writer->splice_size = out->splice_size;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, async_writer_main, writer) != 0) {
+        fprintf(stderr, "Could not start writer thread\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->changed);
+        free(writer);
+        return EXIT_FAILURE;
+    }
+    out->writer = writer;
     return EXIT_SUCCESS;
 }
 
+/**
+ * Make an output buffer splice full buffers into its pipe with vmsplice().
+ *
+ * If the output is not a pipe, or splicing is not supported, the buffer
+ * remains writing with write(). Must be called before out_start_async().
+ *
+ * @param out The output buffer, which must be empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
 int
-process_proc_cpuinfo(const int print_json)
+out_start_splice(out_buffer *out)
 {
-    char rev_code_str[32] = { '\0' };
-    if (read_proc_cpuinfo(rev_code_str, sizeof(rev_code_str)) == EXIT_FAILURE) {
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    struct stat st;
+    if ((fstat(out->fd, &st) != 0) || !S_ISFIFO(st.st_mode)) {
+        return EXIT_SUCCESS;
+    }
+    fcntl(out->fd, F_SETPIPE_SZ, OUT_SPLICE_SIZE);
+    const int pipe_size = fcntl(out->fd, F_GETPIPE_SZ);
+    if (pipe_size <= 0) {
+        return EXIT_SUCCESS;
+    }
+    if (out_allocate_buffers(out, OUT_MAX_BUFFERS,
+                             (size_t) pipe_size) != EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
-    const char *codes[] = { rev_code_str };
-    return process_rev_codes(codes, 1, print_json);
+    out->splice_size = (size_t) pipe_size;
+#else
+    (void) out;
+#endif
+    return EXIT_SUCCESS;
 }
 
 /**
- * Usage: pirevision [-j|--json] [revision code...]
+ * Write all pending output in the buffer to its file descriptor.
  *
- * -j flag causes JSON output instead of text
- * If no revision code(s) supplied, attempt to get it from /proc/cpuinfo and
- * use that, if succesful. Otherwise process each argument as a separate
- * revision code. These must be specified as hexadecimal codes, with, or without
- * 0x or 0X prefix.
+ * With a writer thread, the buffer is handed to that thread and output
+ * continues in the next buffer; the write may not have completed yet on
+ * return (see out_finish()). A buffer without file descriptor (-1) only
+ * collects output in memory, and fails once full.
+ *
+ * @param out The output buffer to flush
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if this or an earlier write failed
  */
 int
-main(const int argc, const char *argv[])
+out_flush(out_buffer *out)
 {
-    int print_json = 0;
-    int first_code_index = 1;
-
-    if (argc > 1) {
-        if ((strcmp(argv[1], "-j") == 0) || (strcmp(argv[1], "--json") == 0)) {
-            print_json = 1;
-            first_code_index++;
+    async_writer *writer = out->writer;
+    if ((out->used > 0) && !out->failed) {
+        if (out->fd < 0) {
+            out->failed = 1;    // Output to memory only, which is full
+        }
+        else if (writer == NULL) {
+            // Writing can block, so let tables be replaced meanwhile
+            const int paused = tables_pause();
+            out->failed = write_block(out->fd, out->data, out->used,
+                                      out->splice_size) != EXIT_SUCCESS;
+            tables_resume(paused);
+        }
+        else {
+            const int paused = tables_pause();
+            pthread_mutex_lock(&writer->lock);
+            while (writer->pending != NULL) {
+                pthread_cond_wait(&writer->changed, &writer->lock);
+            }
+            writer->pending = out->data;
+            writer->pending_used = out->used;
+            out->failed = writer->failed;
+            pthread_cond_broadcast(&writer->changed);
+            pthread_mutex_unlock(&writer->lock);
+            tables_resume(paused);
+        }
+        if (out->buffer_count > 1) {
+            out->current = (out->current + 1) % out->buffer_count;
+            out->data = out->buffers[out->current];
         }
     }
+    out->used = 0;
+    return out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-    // If no extra args, attempt to read from /proc/cpuinfo
-    if (first_code_index >= argc) {
-        return process_proc_cpuinfo(print_json);
+/**
+ * Flush an output buffer and wait until all output has been written.
+ *
+ * A writer thread is stopped, after which the buffer writes directly
+ * again. It is safe to call this more than once.
+ *
+ * @param out The output buffer
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if any write failed
+ */
+int
+out_finish(out_buffer *out)
+{
+    out_flush(out);
+    async_writer *writer = out->writer;
+    if (writer != NULL) {
+        const int paused = tables_pause();
+        out->failed |= async_writer_wait(writer);
+        tables_resume(paused);
+        pthread_mutex_lock(&writer->lock);
+        writer->stop = 1;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+        out->writer = NULL;
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->changed);
+        free(writer);
+    }
+    return out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void
+out_write(out_buffer *out, const char *data, size_t length)
+{
+    // Only ever flush full buffers, as splicing relies on that
+    while (out->used + length > out->size) {
+        const size_t chunk = out->size - out->used;
+        memcpy(out->data + out->used, data, chunk);
+        out->used += chunk;
+        out_flush(out);
+        data += chunk;
+        length -= chunk;
     }
-    return process_rev_codes(&argv[first_code_index],
-                             argc - first_code_index,
-                             print_json);
+    memcpy(out->data + out->used, data, length);
+    out->used += length;
+}
+
+void
+out_puts(out_buffer *out, const char *str)
+{
+    out_write(out, str, strlen(str));
+}
+
+void
+out_putc(out_buffer *out, const char c)
+{
+    if (out->used >= out->size) {
+        out_flush(out);
+    }
+    out->data[out->used++] = c;
+}
+
+#ifdef PIREVISION_ZLIB
+/*
+ * Compressed output (--gzip-output): standard output is written to a pipe
+ * instead, read by a thread that compresses the data with gzip and writes
+ * it to the original standard output.
+ */
+#define DEFLATE_CHUNK   (64 * 1024)
+
+typedef struct {
+    pthread_t thread;
+    int pipe_fd;                // Read end of the pipe with output data
+    int fd;                     // Descriptor receiving compressed output
+    int failed;                 // Set if compression or writing failed
+} output_deflater;
+
+output_deflater *gzip_output = NULL;
+
+void *
+output_deflater_main(void *arg)
+{
+    output_deflater *deflater = arg;
+    unsigned char in[DEFLATE_CHUNK];
+    unsigned char *out = malloc(DEFLATE_CHUNK);
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+    int failed = (out == NULL)
+                 || (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                  15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK);
+    for (;;) {
+        const ssize_t count = read(deflater->pipe_fd, in, sizeof(in));
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (count < 0) {
+            failed = 1;
+            break;
+        }
+        if (failed) {
+            // Keep reading, so writing to the pipe does not block
+            if (count == 0) {
+                break;
+            }
+            continue;
+        }
+        stream.next_in = in;
+        stream.avail_in = (uInt) count;
+        const int flush = (count == 0) ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            stream.next_out = out;
+            stream.avail_out = DEFLATE_CHUNK;
+            deflate(&stream, flush);
+            const size_t length = DEFLATE_CHUNK - stream.avail_out;
+            if ((length > 0)
+                && (write_all(deflater->fd, (const char *) out, length)
+                    != EXIT_SUCCESS)) {
+                failed = 1;
+                break;
+            }
+        } while (stream.avail_out == 0);
+        if (count == 0) {
+            break;
+        }
+    }
+    deflateEnd(&stream);
+    free(out);
+    deflater->failed = failed;
+    return NULL;
+}
+
+/**
+ * Make an output buffer's output compressed with gzip, by a thread.
+ *
+ * @param out The output buffer, which must be empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+out_start_gzip(out_buffer *out)
+{
+    output_deflater *deflater = calloc(1, sizeof(output_deflater));
+    int fds[2];
+    if (deflater == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+        free(deflater);
+        return EXIT_FAILURE;
+    }
+    deflater->pipe_fd = fds[0];
+    deflater->fd = out->fd;
+    if (pthread_create(&deflater->thread, NULL, output_deflater_main, deflater) != 0) {
+        fprintf(stderr, "Could not start compression thread\n");
+        close(fds[0]);
+        close(fds[1]);
+        free(deflater);
+        return EXIT_FAILURE;
+    }
+    out->fd = fds[1];
+    gzip_output = deflater;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Complete compressed output, once the output buffer is finished.
+ *
+ * @param out The output buffer
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if compression failed
+ */
+int
+out_finish_gzip(out_buffer *out)
+{
+    output_deflater *deflater = gzip_output;
+    if (deflater == NULL) {
+        return EXIT_SUCCESS;
+    }
+    close(out->fd);
+    pthread_join(deflater->thread, NULL);
+    close(deflater->pipe_fd);
+    out->fd = deflater->fd;
+    const int failed = deflater->failed;
+    free(deflater);
+    gzip_output = NULL;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+/**
+ * Format a value as hexadecimal, using upper case digits and a 0x prefix.
+ *
+ * This is equivalent to printf's "0x%X" but avoids the format parsing.
+ *
+ * @param value The value to format
+ * @param result Buffer receiving the null terminated result, at least 11 bytes
+ * @returns Pointer to result string (buffer)
+ */
+char *
+hex_str(const revcode_32 value, char *result)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    int shift = 28;
+    while ((shift > 0) && ((value >> shift) & 0xF) == 0) {
+        shift -= 4;
+    }
+    char *p = result;
+    *p++ = '0';
+    *p++ = 'x';
+    for (; shift >= 0; shift -= 4) {
+        *p++ = digits[(value >> shift) & 0xF];
+    }
+    *p = '\0';
+    return result;
+}
+
+void
+flush_stdout_buffer(void)
+{
+    out_finish(&stdout_buffer);
+#ifdef PIREVISION_ZLIB
+    out_finish_gzip(&stdout_buffer);
+#endif
+}
+
+/*
+ * Values of keys in cpuinfo data (see parse_cpuinfo()).
+ */
+#define CPUINFO_REVISION    0x1
+#define CPUINFO_SERIAL      0x2
+#define CPUINFO_MODEL       0x4
+#define CPUINFO_HARDWARE    0x8
+#define CPUINFO_VALUE_SIZE  64
+
+typedef struct {
+    int found;                  // CPUINFO_xxx flags of the keys found
+    char revision[CPUINFO_VALUE_SIZE];
+    char serial[CPUINFO_VALUE_SIZE];
+    char model[CPUINFO_VALUE_SIZE];
+    char hardware[CPUINFO_VALUE_SIZE];
+} cpuinfo_values;
+
+/**
+ * A revision code as supplied, together with its normalized (new style) form.
+ */
+typedef struct {
+    revcode_32 raw_code;        // Code as supplied, possibly old style
+    revcode_32 code;            // Code after map_old_to_new()
+    unsigned long count;        // Number of consecutive occurrences
+    const char *name;           // Name of the device, or NULL
+    const cpuinfo_values *cpuinfo; // Values from cpuinfo data, or NULL
+} revision_record;
+
+/**
+ * Renders a field of a record as a string. Renderers needing to format a
+ * value do so into the scratch buffer, others return a constant string.
+ */
+typedef const char *(*field_renderer)(const revision_record *record,
+                                      char *scratch,
+                                      const size_t scratch_size);
+
+#define FIELD_NEW_STYLE_ONLY    0x1 // Field only present in new style codes
+#define FIELD_RAW_CODE          0x2 // Field extracted from code as supplied
+#define FIELD_NOT_DEFAULT       0x4 // Field only output when selected
+#define FIELD_JSON_NUMBER       0x8 // Rendered value is a JSON number
+#define FIELD_NOT_CODE          0x10 // Field not derived from the code
+
+/**
+ * Declarative description of an output field.
+ *
+ * The value of a field is extracted as a bit field of the (normalized)
+ * revision code. Fields with a renderer use it to produce text, for both
+ * text and JSON output (where it will be quoted). Two-valued fields have
+ * no renderer and instead use the extracted value to select the text or
+ * JSON literal from the respective value arrays.
+ */
+typedef struct {
+    const char *id;             // Name used to select the field
+    const char *name;           // Label used in text output
+    const char *json_key;       // Key used in JSON output
+    unsigned int shift;         // Position of the field in the code
+    revcode_32 mask;            // Mask for field value after shifting
+    field_renderer render;      // NULL for two-valued fields
+    const char *text_values[2]; // Text for two-valued fields
+    const char *json_values[2]; // JSON literals for two-valued fields
+    int flags;                  // FIELD_xxx flags
+} field_descriptor;
+
+const char *
+render_code(const revision_record *record,
+            char *scratch,
+            const size_t scratch_size)
+{
+    (void) scratch_size;
+    return hex_str(record->raw_code, scratch);
+}
+
+/**
+ * Copy a string from the lookup tables to the scratch buffer, so no
+ * pointer into the tables is held while it is output (output can go
+ * offline, see out_flush()).
+ */
+const char *
+render_table_str(const char *text, char *scratch, const size_t scratch_size)
+{
+    size_t length = strlen(text);
+    if (length >= scratch_size) {
+        length = scratch_size - 1;
+    }
+    memcpy(scratch, text, length);
+    scratch[length] = '\0';
+    return scratch;
+}
+
+const char *
+render_type(const revision_record *record,
+            char *scratch,
+            const size_t scratch_size)
+{
+    return render_table_str(type_str(record->code), scratch, scratch_size);
+}
+
+const char *
+render_revision(const revision_record *record,
+                char *scratch,
+                const size_t scratch_size)
+{
+    return render_table_str(revision_str(record->code), scratch, scratch_size);
+}
+
+const char *
+render_processor(const revision_record *record,
+                 char *scratch,
+                 const size_t scratch_size)
+{
+    return render_table_str(processor_str(record->code), scratch, scratch_size);
+}
+
+const char *
+render_memory(const revision_record *record,
+              char *scratch,
+              const size_t scratch_size)
+{
+    return physical_memory_str(record->code, scratch, scratch_size);
+}
+
+/**
+ * Format a value as unsigned decimal, equivalent to printf's "%lu".
+ *
+ * @param value The value to format
+ * @param result Buffer receiving the null terminated result, at least 21 bytes
+ * @returns Pointer to result string (buffer)
+ */
+char *
+decimal_str(unsigned long value, char *result)
+{
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    char *p = result;
+    while (count > 0) {
+        *p++ = digits[--count];
+    }
+    *p = '\0';
+    return result;
+}
+
+const char *
+render_memory_mbytes(const revision_record *record,
+                     char *scratch,
+                     const size_t scratch_size)
+{
+    (void) scratch_size;
+    return decimal_str(physical_memory_mbytes(record->code), scratch);
+}
+
+/**
+ * Render the flags that are not in their default (allowed or intact) state,
+ * separated by '|'. The result is empty if all flags are in default state.
+ */
+const char *
+render_flags(const revision_record *record,
+             char *scratch,
+             const size_t scratch_size)
+{
+    const revcode_32 code = record->code;
+    scratch[0] = '\0';
+    if (!overvoltage_allowed(code)) {
+        strncat(scratch, "|no_overvoltage", scratch_size - strlen(scratch) - 1);
+    }
+    if (!otp_programming_allowed(code)) {
+        strncat(scratch, "|no_otp_programming", scratch_size - strlen(scratch) - 1);
+    }
+    if (!otp_reading_allowed(code)) {
+        strncat(scratch, "|no_otp_reading", scratch_size - strlen(scratch) - 1);
+    }
+    if (!warranty_intact(code)) {
+        strncat(scratch, "|warranty_voided", scratch_size - strlen(scratch) - 1);
+    }
+    return (scratch[0] == '|') ? scratch + 1 : scratch;
+}
+
+const char *
+render_count(const revision_record *record,
+             char *scratch,
+             const size_t scratch_size)
+{
+    (void) scratch_size;
+    return decimal_str(record->count, scratch);
+}
+
+const char *
+render_name(const revision_record *record,
+            char *scratch,
+            const size_t scratch_size)
+{
+    (void) scratch; (void) scratch_size;
+    return (record->name != NULL) ? record->name : "";
+}
+
+const char *
+render_serial(const revision_record *record,
+              char *scratch,
+              const size_t scratch_size)
+{
+    (void) scratch; (void) scratch_size;
+    return (record->cpuinfo != NULL) ? record->cpuinfo->serial : "";
+}
+
+const char *
+render_model(const revision_record *record,
+             char *scratch,
+             const size_t scratch_size)
+{
+    (void) scratch; (void) scratch_size;
+    return (record->cpuinfo != NULL) ? record->cpuinfo->model : "";
+}
+
+const char *
+render_hardware(const revision_record *record,
+                char *scratch,
+                const size_t scratch_size)
+{
+    (void) scratch; (void) scratch_size;
+    return (record->cpuinfo != NULL) ? record->cpuinfo->hardware : "";
+}
+
+const char *
+render_descriptor(const revision_record *record,
+                  char *scratch,
+                  const size_t scratch_size)
+{
+    snprintf(scratch, scratch_size, "0x%016llX",
+             (unsigned long long) describe_normalized(record->code));
+    return scratch;
+}
+
+const char *
+render_manufacturer(const revision_record *record,
+                    char *scratch,
+                    const size_t scratch_size)
+{
+    return render_table_str(manufacturer_str(record->code), scratch, scratch_size);
+}
+
+/*
+ * All output fields, in output order. Every output format walks this table,
+ * so a field added here shows up in all of them.
+ */
+const field_descriptor field_table[] = {
+    { "code", "Code", "revision_code", 0, 0xFFFFFFFF, render_code,
+      { NULL, NULL }, { NULL, NULL }, FIELD_RAW_CODE },
+    { "style", "Style", "style", 23, 0x1, NULL,
+      { "Old", "New" }, { "\"old\"", "\"new\"" }, 0 },
+    // NOTE: For the flags 0 means allowed (or intact), 1 disallowed (voided)
+    { "overvoltage", "Overvoltage", "overvoltage_allowed", 31, 0x1, NULL,
+      { "Allowed", "Disallowed" }, { "true", "false" },
+      FIELD_NEW_STYLE_ONLY },
+    { "otp_programming", "OTP Programming", "otp_programming_allowed", 30, 0x1, NULL,
+      { "Allowed", "Disallowed" }, { "true", "false" },
+      FIELD_NEW_STYLE_ONLY },
+    { "otp_reading", "OTP Reading", "otp_reading_allowed", 29, 0x1, NULL,
+      { "Allowed", "Disallowed" }, { "true", "false" },
+      FIELD_NEW_STYLE_ONLY },
+    { "warranty", "Warranty", "warranty_intact", 25, 0x1, NULL,
+      { "Intact", "Voided" }, { "true", "false" },
+      FIELD_NEW_STYLE_ONLY },
+    { "type", "Type/Model", "type", 4, 0xFF, render_type,
+      { NULL, NULL }, { NULL, NULL }, 0 },
+    { "revision", "Revision", "revision", 0, 0xF, render_revision,
+      { NULL, NULL }, { NULL, NULL }, 0 },
+    { "processor", "Processor/SOC", "processor", 12, 0xF, render_processor,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NEW_STYLE_ONLY },
+    { "memory", "Memory", "memory", 20, 0x7, render_memory,
+      { NULL, NULL }, { NULL, NULL }, 0 },
+    { "manufacturer", "Manufacturer", "manufacturer", 16, 0xF, render_manufacturer,
+      { NULL, NULL }, { NULL, NULL }, 0 },
+    { "memory_mb", "Memory (MB)", "memory_mb", 20, 0x7, render_memory_mbytes,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NOT_DEFAULT },
+    // Bits 25, 29, 30 and 31 (warranty, OTP reading, OTP programming, overvoltage)
+    { "flags", "Flags", "flags", 25, 0x71, render_flags,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NEW_STYLE_ONLY | FIELD_NOT_DEFAULT },
+    // Not part of the code: number of consecutive occurrences of the code
+    { "count", "Count", "count", 0, 0x0, render_count,
+      { NULL, NULL }, { NULL, NULL },
+      FIELD_NOT_DEFAULT | FIELD_JSON_NUMBER | FIELD_NOT_CODE },
+    // Not part of the code: name of the device (host id, file), if known
+    { "name", "Name", "name", 0, 0x0, render_name,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NOT_DEFAULT | FIELD_NOT_CODE },
+    // Packed descriptor of the decoded code (see revision_descriptor)
+    { "descriptor", "Descriptor", "descriptor", 0, 0x0, render_descriptor,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NOT_DEFAULT },
+    // Not part of the code: values from the cpuinfo file, if known
+    { "serial", "Serial", "serial", 0, 0x0, render_serial,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NOT_DEFAULT | FIELD_NOT_CODE },
+    { "model", "Model", "model", 0, 0x0, render_model,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NOT_DEFAULT | FIELD_NOT_CODE },
+    { "hardware", "Hardware", "hardware", 0, 0x0, render_hardware,
+      { NULL, NULL }, { NULL, NULL }, FIELD_NOT_DEFAULT | FIELD_NOT_CODE },
+};
+
+#define FIELD_SCRATCH_SIZE 80   // Large enough for any rendered value
+
+unsigned int
+field_value(const field_descriptor *field, const revision_record *record)
+{
+    const revcode_32 code = (field->flags & FIELD_RAW_CODE)
+                ? record->raw_code
+                : record->code;
+    return (code >> field->shift) & field->mask;
+}
+
+const char *
+field_text(const field_descriptor *field,
+           const revision_record *record,
+           char *scratch,
+           const size_t scratch_size)
+{
+    if (field->render != NULL) {
+        return field->render(record, scratch, scratch_size);
+    }
+    return field->text_values[field_value(field, record)];
+}
+
+/**
+ * Whether a field is to be output for the record.
+ */
+int
+field_applies(const field_descriptor *field, const revision_record *record)
+{
+    return !(field->flags & FIELD_NEW_STYLE_ONLY)
+           || revision_new_style(record->code);
+}
+
+/*
+ * Fields selected for output, in output order. Only selected fields are
+ * extracted and rendered, so limiting the selection saves decoding work
+ * as well as output.
+ */
+#define MAX_SELECTED_FIELDS 32
+
+typedef struct {
+    int count;
+    const field_descriptor *fields[MAX_SELECTED_FIELDS];
+} field_selection;
+
+/**
+ * Look up a field by its id.
+ *
+ * @param id Start of the id, need not be null terminated
+ * @param id_length Length of the id
+ * @returns The field descriptor or NULL if there is no such field
+ */
+const field_descriptor *
+find_field(const char *id, const size_t id_length)
+{
+    for (size_t index = 0; index < ARRAY_CNT(field_table); ++index) {
+        const char *field_id = field_table[index].id;
+        if ((strncmp(field_id, id, id_length) == 0)
+            && (field_id[id_length] == '\0')) {
+            return &field_table[index];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Select the fields output by default.
+ *
+ * Text output shows the code as supplied in its header, so the code field
+ * is only selected by default for JSON.
+ *
+ * @param selection Receives the selected fields
+ * @param print_json Whether selecting for JSON output
+ */
+void
+select_default_fields(field_selection *selection, const int print_json)
+{
+    selection->count = 0;
+    for (size_t index = 0; index < ARRAY_CNT(field_table); ++index) {
+        const field_descriptor *field = &field_table[index];
+        if (field->flags & FIELD_NOT_DEFAULT) {
+            continue;
+        }
+        if (print_json || !(field->flags & FIELD_RAW_CODE)) {
+            selection->fields[selection->count++] = field;
+        }
+    }
+}
+
+/**
+ * Add the count field to a selection, unless already selected.
+ */
+void
+select_count_field(field_selection *selection)
+{
+    const field_descriptor *count_field = find_field("count", 5);
+    int index = 0;
+    while ((index < selection->count)
+           && (selection->fields[index] != count_field)) {
+        ++index;
+    }
+    if ((index == selection->count) && (selection->count < MAX_SELECTED_FIELDS)) {
+        selection->fields[selection->count++] = count_field;
+    }
+}
+
+/**
+ * Parse a comma separated list of field ids into a selection.
+ *
+ * @param list The field list, e.g. "type,memory", each field at most once
+ * @param selection Receives the selected fields, in list order
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the list is not valid
+ */
+int
+parse_field_list(const char *list, field_selection *selection)
+{
+    selection->count = 0;
+    const char *start = list;
+    for (;;) {
+        const char *end = strchr(start, ',');
+        const size_t length = (end != NULL) ? (size_t) (end - start)
+                                            : strlen(start);
+        const field_descriptor *field = find_field(start, length);
+        if (field == NULL) {
+            fprintf(stderr, "Unknown field \"%.*s\"\n", (int) length, start);
+            return EXIT_FAILURE;
+        }
+        for (int index = 0; index < selection->count; ++index) {
+            if (selection->fields[index] == field) {
+                fprintf(stderr, "Duplicate field \"%.*s\"\n", (int) length, start);
+                return EXIT_FAILURE;
+            }
+        }
+        if (selection->count >= MAX_SELECTED_FIELDS) {
+            fprintf(stderr, "Too many fields selected\n");
+            return EXIT_FAILURE;
+        }
+        selection->fields[selection->count++] = field;
+        if (end == NULL) {
+            break;
+        }
+        start = end + 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Constraints on decoded fields, such as "type=4B" or "memory>=2GB", as used
+ * for queries. Values are matched against a field's text (ignoring case),
+ * or can be given as the field's numeric value. As several values can have
+ * the same text (such as manufacturer "Embest"), a constraint holds the set
+ * of all values it accepts. Ordering compares the numeric values, which for
+ * memory and revision follows the text.
+ */
+#define MAX_CONSTRAINTS     16
+#define CONSTRAINT_VALUES   256     // Values of the widest field (type)
+
+typedef enum {
+    CONSTRAINT_EQ,
+    CONSTRAINT_NE,
+    CONSTRAINT_LT,
+    CONSTRAINT_LE,
+    CONSTRAINT_GT,
+    CONSTRAINT_GE,
+} constraint_op;
+
+typedef struct {
+    const field_descriptor *field;
+    uint64_t accepted[CONSTRAINT_VALUES / 64]; // Set of values accepted
+} field_constraint;
+
+void
+value_set_add(uint64_t *set, const unsigned int value)
+{
+    set[value / 64] |= (uint64_t) 1 << (value % 64);
+}
+
+int
+value_set_contains(const uint64_t *set, const unsigned int value)
+{
+    return (value < CONSTRAINT_VALUES)
+           && ((set[value / 64] >> (value % 64)) & 1);
+}
+
+/**
+ * Find the values of a field, given their text or a numeric value.
+ *
+ * @param field The field
+ * @param text The text to match, e.g. "4B" for the type field
+ * @param text_length Length of the text
+ * @param values Receives the set of matching values, must be empty
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if there is no such value
+ */
+int
+parse_field_values(const field_descriptor *field,
+                   const char *text,
+                   const size_t text_length,
+                   uint64_t *values)
+{
+    char scratch[FIELD_SCRATCH_SIZE];
+    int found = 0;
+
+    // Only fields taken from the code, and not the code itself, have values
+    if ((field->mask == 0) || (field->flags & FIELD_RAW_CODE)) {
+        return EXIT_FAILURE;
+    }
+    for (unsigned int candidate = 0; candidate <= field->mask; ++candidate) {
+        // Render as a new style code, unless it is the style being chosen
+        const revcode_32 code = (candidate << field->shift)
+                                | ((field->shift == 23) ? 0 : (1 << 23));
+        const revision_record record = { code, code, 1, NULL, NULL };
+        const char *candidate_text = field_text(field, &record,
+                                                scratch, sizeof(scratch));
+        if (((strlen(candidate_text) == text_length)
+             && (strncasecmp(candidate_text, text, text_length) == 0))
+            || ((field->render == NULL)
+                && (strlen(field->json_values[candidate]) == text_length)
+                && (strncmp(field->json_values[candidate], text, text_length) == 0))) {
+            value_set_add(values, candidate);
+            found = 1;
+        }
+    }
+    char number[16];
+    if (!found && (text_length > 0) && (text_length < sizeof(number))) {
+        char *end;
+        memcpy(number, text, text_length);
+        number[text_length] = '\0';
+        const unsigned long candidate = strtoul(number, &end, 0);
+        if ((*end == '\0') && (candidate <= field->mask)) {
+            value_set_add(values, (unsigned int) candidate);
+            found = 1;
+        }
+    }
+    return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Parse a comma separated list of constraints, e.g. "type=4B,memory>=2GB".
+ * The operators are =, !=, <, <=, > and >=. Where the value names several
+ * field values, = accepts any of them and != none of them, < and >= compare
+ * with the lowest of them, and <= and > with the highest.
+ *
+ * @param text The constraints
+ * @param constraints Receives the constraints
+ * @param count Receives the number of constraints
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the list is not valid
+ */
+int
+parse_constraints(const char *text, field_constraint *constraints, int *count)
+{
+    *count = 0;
+    const char *start = text;
+    for (;;) {
+        const char *end = strchr(start, ',');
+        const size_t length = (end != NULL) ? (size_t) (end - start)
+                                            : strlen(start);
+        const size_t id_length = strcspn(start, "=!<>");
+        if (id_length >= length) {
+            fprintf(stderr, "Invalid constraint \"%.*s\"\n", (int) length, start);
+            return EXIT_FAILURE;
+        }
+        const field_descriptor *field = find_field(start, id_length);
+        if (field == NULL) {
+            fprintf(stderr, "Unknown field \"%.*s\"\n", (int) id_length, start);
+            return EXIT_FAILURE;
+        }
+        if (*count >= MAX_CONSTRAINTS) {
+            fprintf(stderr, "Too many constraints\n");
+            return EXIT_FAILURE;
+        }
+        field_constraint *constraint = &constraints[(*count)++];
+        constraint->field = field;
+        const char *value = start + id_length;
+        const int or_equal = value[1] == '=';
+        constraint_op op;
+        switch (value[0]) {
+        case '!':
+            op = CONSTRAINT_NE;
+            break;
+        case '<':
+            op = or_equal ? CONSTRAINT_LE : CONSTRAINT_LT;
+            break;
+        case '>':
+            op = or_equal ? CONSTRAINT_GE : CONSTRAINT_GT;
+            break;
+        default:
+            op = CONSTRAINT_EQ;
+            break;
+        }
+        value += or_equal ? 2 : 1;
+        uint64_t values[CONSTRAINT_VALUES / 64] = { 0 };
+        // "!" must be followed by "=", and "=" must not be doubled
+        if (((op == CONSTRAINT_NE) && !or_equal)
+            || ((op == CONSTRAINT_EQ) && or_equal)
+            || (parse_field_values(field, value, (size_t) (start + length - value),
+                                   values) != EXIT_SUCCESS)) {
+            fprintf(stderr, "Invalid constraint \"%.*s\" on field %s\n",
+                    (int) length, start, field->id);
+            return EXIT_FAILURE;
+        }
+        unsigned int lowest = field->mask;
+        unsigned int highest = 0;
+        for (unsigned int candidate = 0; candidate <= field->mask; ++candidate) {
+            if (value_set_contains(values, candidate)) {
+                lowest = (candidate < lowest) ? candidate : lowest;
+                highest = candidate;
+            }
+        }
+        memset(constraint->accepted, 0, sizeof(constraint->accepted));
+        for (unsigned int candidate = 0; candidate <= field->mask; ++candidate) {
+            int accepted;
+            switch (op) {
+            case CONSTRAINT_NE:
+                accepted = !value_set_contains(values, candidate);
+                break;
+            case CONSTRAINT_LT:
+                accepted = candidate < lowest;
+                break;
+            case CONSTRAINT_LE:
+                accepted = candidate <= highest;
+                break;
+            case CONSTRAINT_GT:
+                accepted = candidate > highest;
+                break;
+            case CONSTRAINT_GE:
+                accepted = candidate >= lowest;
+                break;
+            default:
+                accepted = value_set_contains(values, candidate);
+                break;
+            }
+            if (accepted) {
+                value_set_add(constraint->accepted, candidate);
+            }
+        }
+        if (end == NULL) {
+            break;
+        }
+        start = end + 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+constraint_accepts(const field_constraint *constraint, const unsigned int value)
+{
+    return value_set_contains(constraint->accepted, value);
+}
+
+int
+constraints_match(const field_constraint *constraints,
+                  const int count,
+                  const revision_record *record)
+{
+    for (int index = 0; index < count; ++index) {
+        if (!constraint_accepts(&constraints[index],
+                                field_value(constraints[index].field, record))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void
+emit_revision_text(out_buffer *out,
+                   const field_selection *selection,
+                   const revision_record *record)
+{
+    static const char padding[] = "                ";  // Label width 16
+    char scratch[FIELD_SCRATCH_SIZE];
+
+    out_puts(out, "Revision code ");
+    out_puts(out, hex_str(record->raw_code, scratch));
+    out_puts(out, " interpreted:\n");
+
+    for (int index = 0; index < selection->count; ++index) {
+        const field_descriptor *field = selection->fields[index];
+        if (!field_applies(field, record)) {
+            continue;
+        }
+        const size_t name_length = strlen(field->name);
+        out_write(out, "    ", 4);
+        out_write(out, field->name, name_length);
+        if (name_length < sizeof(padding) - 1) {
+            out_write(out, padding, sizeof(padding) - 1 - name_length);
+        }
+        out_write(out, ": ", 2);
+        out_puts(out, field_text(field, record, scratch, sizeof(scratch)));
+        out_putc(out, '\n');
+    }
+}
+
+/**
+ * Output a value as a JSON string, escaping quotes, backslashes and control
+ * characters.
+ */
+void
+out_json_string(out_buffer *out, const char *value, const size_t length)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const char *end = value + length;
+    const char *start = value;
+
+    out_putc(out, '"');
+    for (const char *p = value; p < end; ++p) {
+        const unsigned char c = (unsigned char) *p;
+        if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+            continue;
+        }
+        out_write(out, start, (size_t) (p - start));
+        start = p + 1;
+        out_putc(out, '\\');
+        switch (c) {
+        case '"':
+        case '\\':
+            out_putc(out, (char) c);
+            break;
+        case '\n':
+            out_putc(out, 'n');
+            break;
+        case '\r':
+            out_putc(out, 'r');
+            break;
+        case '\t':
+            out_putc(out, 't');
+            break;
+        default:
+            out_puts(out, "u00");
+            out_putc(out, hex_digits[c >> 4]);
+            out_putc(out, hex_digits[c & 0xF]);
+            break;
+        }
+    }
+    out_write(out, start, (size_t) (end - start));
+    out_putc(out, '"');
+}
+
+/**
+ * Output the JSON value of a field.
+ */
+void
+emit_json_value(out_buffer *out,
+                const field_descriptor *field,
+                const revision_record *record)
+{
+    char scratch[FIELD_SCRATCH_SIZE];
+
+    if (field->flags & FIELD_JSON_NUMBER) {
+        out_puts(out, field->render(record, scratch, sizeof(scratch)));
+    }
+    else if (field->render != NULL) {
+        const char *text = field->render(record, scratch, sizeof(scratch));
+        out_json_string(out, text, strlen(text));
+    }
+    else {
+        out_puts(out, field->json_values[field_value(field, record)]);
+    }
+}
+
+/**
+ * Output a record as a JSON object.
+ *
+ * @param out Output buffer
+ * @param selection Fields to output
+ * @param record The record
+ * @param compact If set, the object is output on a single line without
+ *                white space or terminating newline, as in NDJSON
+ */
+void
+emit_revision_json(out_buffer *out,
+                   const field_selection *selection,
+                   const revision_record *record,
+                   const int compact)
+{
+    const char *separator = compact ? "\"" : "\n    \"";
+
+    // The object is opened even if no field applies to the record (such as
+    // only new style fields selected for an old style code)
+    out_putc(out, '{');
+    for (int index = 0; index < selection->count; ++index) {
+        const field_descriptor *field = selection->fields[index];
+        if (!field_applies(field, record)) {
+            continue;
+        }
+        out_puts(out, separator);
+        out_puts(out, field->json_key);
+        out_write(out, "\": ", compact ? 2 : 3);
+        emit_json_value(out, field, record);
+        separator = compact ? ",\"" : ",\n    \"";
+    }
+    if (compact) {
+        out_putc(out, '}');
+    }
+    else {
+        out_puts(out, "\n}\n");
+    }
+}
+
+/*
+ * A user supplied output template, such as "{code:x} {type} {memory_mb}",
+ * is compiled once into a render program: a list of operations that either
+ * copy a literal or emit a field. Executing the program for a record then
+ * involves no parsing at all.
+ */
+#define MAX_TEMPLATE_OPS    64
+#define MAX_TEMPLATE_SIZE   1024
+
+typedef enum {
+    OP_LITERAL,                 // Copy literal text
+    OP_FIELD                    // Emit a field
+} template_op_kind;
+
+typedef struct {
+    template_op_kind kind;
+    char conversion;            // Field: '\0' (text), 'x', 'X' or 'd'
+    const field_descriptor *field;
+    const char *literal;        // Literal: points into program literals
+    size_t length;              // Literal: number of bytes
+} template_op;
+
+typedef struct {
+    int count;
+    template_op ops[MAX_TEMPLATE_OPS];
+    char literals[MAX_TEMPLATE_SIZE];
+} render_program;
+
+/**
+ * Compile an output template into a render program.
+ *
+ * Fields are referenced as {id} or {id:conversion}, where the conversion
+ * is one of x or X (field value in lower or upper case hexadecimal) or d
+ * (field value in decimal), for fields taken from the code. Without a
+ * conversion the field's text is used.
+ * Use {{ and }} for literal braces, and \n, \t and \\ for newline, tab
+ * and backslash. Every record is terminated by a newline.
+ *
+ * @param template The template to compile
+ * @param program Receives the compiled program
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the template is not valid
+ */
+int
+compile_template(const char *template, render_program *program)
+{
+    size_t literal_used = 0;
+    template_op *op = NULL;     // Literal op currently being extended
+
+    program->count = 0;
+    for (const char *p = template; *p != '\0'; ++p) {
+        char c = *p;
+        if ((c == '{') && (p[1] != '{')) {
+            const char *end = strchr(p, '}');
+            if (end == NULL) {
+                fprintf(stderr, "Unterminated field in template \"%s\"\n",
+                        template);
+                return EXIT_FAILURE;
+            }
+            const char *colon = memchr(p, ':', (size_t) (end - p));
+            const char *id_end = (colon != NULL) ? colon : end;
+            const field_descriptor *field = find_field(p + 1,
+                                                       (size_t) (id_end - p - 1));
+            if (field == NULL) {
+                fprintf(stderr, "Unknown field \"%.*s\" in template\n",
+                        (int) (id_end - p - 1), p + 1);
+                return EXIT_FAILURE;
+            }
+            char conversion = '\0';
+            if (colon != NULL) {
+                conversion = colon[1];
+                if ((end != colon + 2) || (strchr("xXd", conversion) == NULL)
+                    || (field->mask == 0)) {
+                    fprintf(stderr, "Invalid conversion \"%.*s\" in template\n",
+                            (int) (end - colon - 1), colon + 1);
+                    return EXIT_FAILURE;
+                }
+            }
+            if (program->count >= MAX_TEMPLATE_OPS) {
+                fprintf(stderr, "Template too complex\n");
+                return EXIT_FAILURE;
+            }
+            op = &program->ops[program->count++];
+            op->kind = OP_FIELD;
+            op->conversion = conversion;
+            op->field = field;
+            op->literal = NULL;
+            op->length = 0;
+            op = NULL;
+            p = end;
+            continue;
+        }
+
+        if ((c == '}') && (p[1] != '}')) {
+            fprintf(stderr, "Unpaired } in template \"%s\"\n", template);
+            return EXIT_FAILURE;
+        }
+        if ((c == '{') || (c == '}')) {
+            ++p;                // Doubled brace
+        }
+        else if ((c == '\\') && (p[1] != '\0')) {
+            c = *++p;
+            c = (c == 'n') ? '\n' : (c == 't') ? '\t' : c;
+        }
+        if (literal_used + 1 >= sizeof(program->literals)) {
+            fprintf(stderr, "Template too long\n");
+            return EXIT_FAILURE;
+        }
+        if (op == NULL) {
+            if (program->count >= MAX_TEMPLATE_OPS) {
+                fprintf(stderr, "Template too complex\n");
+                return EXIT_FAILURE;
+            }
+            op = &program->ops[program->count++];
+            op->kind = OP_LITERAL;
+            op->conversion = '\0';
+            op->field = NULL;
+            op->literal = &program->literals[literal_used];
+            op->length = 0;
+        }
+        program->literals[literal_used++] = c;
+        op->length++;
+    }
+    return EXIT_SUCCESS;
+}
+
+void
+emit_revision_template(out_buffer *out,
+                       const render_program *program,
+                       const revision_record *record)
+{
+    char scratch[FIELD_SCRATCH_SIZE];
+
+    for (int index = 0; index < program->count; ++index) {
+        const template_op *op = &program->ops[index];
+        if (op->kind == OP_LITERAL) {
+            out_write(out, op->literal, op->length);
+            continue;
+        }
+        if (!field_applies(op->field, record)) {
+            continue;
+        }
+        switch (op->conversion) {
+        case 'x':
+        case 'X': {
+            char *hex = hex_str(field_value(op->field, record), scratch);
+            if (op->conversion == 'x') {
+                for (char *p = hex; *p != '\0'; ++p) {
+                    if ((*p >= 'A') && (*p <= 'F')) {
+                        *p = (char) (*p - 'A' + 'a');
+                    }
+                }
+            }
+            out_puts(out, hex + 2);     // Without 0x prefix
+            break;
+        }
+        case 'd':
+            out_puts(out, decimal_str(field_value(op->field, record), scratch));
+            break;
+        default:
+            out_puts(out, field_text(op->field, record, scratch, sizeof(scratch)));
+            break;
+        }
+    }
+    out_putc(out, '\n');
+}
+
+/**
+ * Output a value as a CSV field, quoting it if needed.
+ */
+void
+out_csv_value(out_buffer *out, const char *value)
+{
+    if (strpbrk(value, ",\"\r\n") == NULL) {
+        out_puts(out, value);
+        return;
+    }
+    out_putc(out, '"');
+    for (const char *p = value; *p != '\0'; ++p) {
+        if (*p == '"') {
+            out_putc(out, '"');
+        }
+        out_putc(out, *p);
+    }
+    out_putc(out, '"');
+}
+
+/**
+ * Output a record as CSV, preceded by a header line for the first record.
+ */
+void
+emit_revision_csv(out_buffer *out,
+                  const field_selection *selection,
+                  const revision_record *record,
+                  const int header)
+{
+    char scratch[FIELD_SCRATCH_SIZE];
+
+    if (header) {
+        for (int index = 0; index < selection->count; ++index) {
+            if (index > 0) {
+                out_putc(out, ',');
+            }
+            out_csv_value(out, selection->fields[index]->id);
+        }
+        out_putc(out, '\n');
+    }
+    for (int index = 0; index < selection->count; ++index) {
+        const field_descriptor *field = selection->fields[index];
+        if (index > 0) {
+            out_putc(out, ',');
+        }
+        if (field_applies(field, record)) {
+            out_csv_value(out, field_text(field, record, scratch, sizeof(scratch)));
+        }
+    }
+    out_putc(out, '\n');
+}
+
+void
+store_le32(unsigned char *bytes, const unsigned long value)
+{
+    bytes[0] = (unsigned char) (value & 0xFF);
+    bytes[1] = (unsigned char) ((value >> 8) & 0xFF);
+    bytes[2] = (unsigned char) ((value >> 16) & 0xFF);
+    bytes[3] = (unsigned char) ((value >> 24) & 0xFF);
+}
+
+/**
+ * Output a record as a binary record of three little endian 32-bit values:
+ * the code as supplied, the normalized (new style) code and the count
+ * (limited to 0xFFFFFFFF).
+ */
+void
+emit_revision_binary(out_buffer *out, const revision_record *record)
+{
+    unsigned char bytes[12];
+    store_le32(bytes, record->raw_code);
+    store_le32(bytes + 4, record->code);
+    store_le32(bytes + 8, (record->count > 0xFFFFFFFF) ? 0xFFFFFFFF
+                                                        : record->count);
+    out_write(out, (const char *) bytes, sizeof(bytes));
+}
+
+/**
+ * Output a record as its descriptor, a little endian 64-bit value.
+ */
+void
+emit_revision_descriptor(out_buffer *out, const revision_record *record)
+{
+    const revision_descriptor descriptor = describe_normalized(record->code);
+    unsigned char bytes[8];
+    store_le32(bytes, (unsigned long) (descriptor & 0xFFFFFFFF));
+    store_le32(bytes + 4, (unsigned long) (descriptor >> 32));
+    out_write(out, (const char *) bytes, sizeof(bytes));
+}
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_TEMPLATE,
+    FORMAT_CSV,
+    FORMAT_BINARY,
+    FORMAT_DESCRIPTOR
+} output_format;
+
+/**
+ * How records are to be output.
+ */
+typedef struct {
+    output_format format;
+    field_selection selection;  // Fields to output, for text, JSON and CSV
+    render_program program;     // Compiled template, for FORMAT_TEMPLATE
+    int collapse_runs;          // Output runs of the same code only once
+    int group_headers;          // Output a header line per sort key
+} output_spec;
+
+/*
+ * Sorting of records by a key of decoded fields (--sort-by).
+ *
+ * Records are collected as 64-bit entries holding the key (the values of
+ * the key fields, most significant first) in the upper half and the code
+ * as supplied in the lower half, so sorting entries sorts by key and then
+ * by code. Entries are sorted with an LSD radix sort, skipping the byte
+ * positions where all entries are equal. When the entries reach the memory
+ * limit they are sorted and spilled to a temporary file as a run, and runs
+ * are merged when output. To bound the number of open files, runs are
+ * merged into a single run whenever SORT_MAX_RUNS exist.
+ */
+#define SORT_MAX_RUNS       64
+#define SORT_RUN_ENTRIES    8192        // Entries buffered per run merged
+#define SORT_DEFAULT_MEMORY 256         // MB of entries before spilling
+
+typedef struct {
+    FILE *file;
+    uint64_t *buffer;
+    size_t count;               // Entries in buffer
+    size_t position;            // Next entry in buffer
+} sort_run_reader;
+
+typedef struct {
+    field_selection fields;     // Key fields, most significant first
+    uint64_t *entries;
+    uint64_t *scratch;          // Second buffer for radix sort passes
+    size_t count;
+    size_t allocated;           // Entries the buffers hold
+    size_t capacity;            // Entries collected before spilling
+    FILE *runs[SORT_MAX_RUNS];  // Sorted runs spilled so far
+    int run_count;
+    // Output state: the sorted entries in memory, or the runs being merged
+    const uint64_t *sorted;
+    size_t next;
+    sort_run_reader readers[SORT_MAX_RUNS];
+    int heap[SORT_MAX_RUNS];    // Readers with entries left, as a min heap
+    int heap_count;
+    int failed;                 // Reading a run failed
+} record_sorter;
+
+/**
+ * Number of bits of a field's value.
+ */
+unsigned int
+field_width(const field_descriptor *field)
+{
+    unsigned int width = 0;
+    while ((width < 32) && ((field->mask >> width) != 0)) {
+        ++width;
+    }
+    return width;
+}
+
+/**
+ * Set up sorting by a list of fields.
+ *
+ * @param sorter The sorter to set up
+ * @param list Comma separated ids of the key fields, e.g. "type,memory"
+ * @param memory_mbytes Memory to use for entries before spilling runs
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the list is not valid
+ */
+int
+record_sorter_init(record_sorter *sorter,
+                   const char *list,
+                   const unsigned long memory_mbytes)
+{
+    memset(sorter, 0, sizeof(*sorter));
+    if (parse_field_list(list, &sorter->fields) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    unsigned int key_bits = 0;
+    for (int index = 0; index < sorter->fields.count; ++index) {
+        const field_descriptor *field = sorter->fields.fields[index];
+        if ((field->mask == 0) || (field->flags & FIELD_RAW_CODE)) {
+            fprintf(stderr, "Cannot sort by field \"%s\"\n", field->id);
+            return EXIT_FAILURE;
+        }
+        key_bits += field_width(field);
+    }
+    if (key_bits > 32) {
+        fprintf(stderr, "Too many sort fields\n");
+        return EXIT_FAILURE;
+    }
+    // Two buffers of entries, one for each radix sort pass direction. They
+    // start small and grow up to the memory limit as entries are added
+    sorter->capacity = (size_t) memory_mbytes * 1024 * 1024 / (2 * sizeof(uint64_t));
+    if (sorter->capacity < SORT_RUN_ENTRIES) {
+        sorter->capacity = SORT_RUN_ENTRIES;
+    }
+    sorter->allocated = SORT_RUN_ENTRIES;
+    sorter->entries = malloc(sorter->allocated * sizeof(uint64_t));
+    sorter->scratch = malloc(sorter->allocated * sizeof(uint64_t));
+    if ((sorter->entries == NULL) || (sorter->scratch == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void
+record_sorter_free(record_sorter *sorter)
+{
+    free(sorter->entries);
+    free(sorter->scratch);
+    for (int index = 0; index < sorter->run_count; ++index) {
+        fclose(sorter->runs[index]);
+    }
+    for (int index = 0; index < SORT_MAX_RUNS; ++index) {
+        free(sorter->readers[index].buffer);
+    }
+    sorter->run_count = 0;
+}
+
+/**
+ * Sort entries with an LSD radix sort on their bytes.
+ *
+ * @param entries The entries to sort
+ * @param scratch Buffer of the same size, used for alternate passes
+ * @param count Number of entries
+ * @returns The buffer (entries or scratch) holding the sorted entries
+ */
+uint64_t *
+sort_entries(uint64_t *entries, uint64_t *scratch, const size_t count)
+{
+    size_t histograms[8][256];
+
+    if (count < 2) {
+        return entries;
+    }
+    memset(histograms, 0, sizeof(histograms));
+    for (size_t index = 0; index < count; ++index) {
+        const uint64_t entry = entries[index];
+        for (int byte = 0; byte < 8; ++byte) {
+            histograms[byte][(entry >> (byte * 8)) & 0xFF]++;
+        }
+    }
+    uint64_t *from = entries;
+    uint64_t *to = scratch;
+    for (int byte = 0; byte < 8; ++byte) {
+        size_t *histogram = histograms[byte];
+        const unsigned int shift = (unsigned int) byte * 8;
+        // All entries have the same byte value: the pass changes nothing
+        if (histogram[(from[0] >> shift) & 0xFF] == count) {
+            continue;
+        }
+        size_t offset = 0;
+        for (int value = 0; value < 256; ++value) {
+            const size_t value_count = histogram[value];
+            histogram[value] = offset;
+            offset += value_count;
+        }
+        for (size_t index = 0; index < count; ++index) {
+            const uint64_t entry = from[index];
+            to[histogram[(entry >> shift) & 0xFF]++] = entry;
+        }
+        uint64_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    return from;
+}
+
+/**
+ * Refill the buffer of a run being merged.
+ *
+ * @returns Whether there are entries left in the run
+ */
+int
+sort_run_fill(record_sorter *sorter, sort_run_reader *reader)
+{
+    reader->count = fread(reader->buffer, sizeof(uint64_t), SORT_RUN_ENTRIES,
+                          reader->file);
+    reader->position = 0;
+    if ((reader->count == 0) && ferror(reader->file)) {
+        fprintf(stderr, "Could not read sort run\n");
+        sorter->failed = 1;
+    }
+    return reader->count > 0;
+}
+
+uint64_t
+sort_heap_entry(const record_sorter *sorter, const int heap_index)
+{
+    const sort_run_reader *reader = &sorter->readers[sorter->heap[heap_index]];
+    return reader->buffer[reader->position];
+}
+
+/**
+ * Restore the heap order after the entry at a position grew.
+ */
+void
+sort_heap_down(record_sorter *sorter, int position)
+{
+    for (;;) {
+        int smallest = position;
+        const int left = 2 * position + 1;
+        const int right = left + 1;
+        if ((left < sorter->heap_count)
+            && (sort_heap_entry(sorter, left) < sort_heap_entry(sorter, smallest))) {
+            smallest = left;
+        }
+        if ((right < sorter->heap_count)
+            && (sort_heap_entry(sorter, right) < sort_heap_entry(sorter, smallest))) {
+            smallest = right;
+        }
+        if (smallest == position) {
+            return;
+        }
+        const int swap = sorter->heap[position];
+        sorter->heap[position] = sorter->heap[smallest];
+        sorter->heap[smallest] = swap;
+        position = smallest;
+    }
+}
+
+/**
+ * Start merging the spilled runs.
+ */
+int
+sort_merge_start(record_sorter *sorter)
+{
+    sorter->heap_count = 0;
+    for (int index = 0; index < sorter->run_count; ++index) {
+        sort_run_reader *reader = &sorter->readers[index];
+        reader->file = sorter->runs[index];
+        if (reader->buffer == NULL) {
+            reader->buffer = malloc(SORT_RUN_ENTRIES * sizeof(uint64_t));
+            if (reader->buffer == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+            }
+        }
+        rewind(reader->file);
+        if (sort_run_fill(sorter, reader)) {
+            sorter->heap[sorter->heap_count++] = index;
+        }
+    }
+    for (int position = sorter->heap_count / 2 - 1; position >= 0; --position) {
+        sort_heap_down(sorter, position);
+    }
+    return sorter->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Get the next entry in sort order, once sort_finish() was called.
+ *
+ * @returns Whether there was an entry
+ */
+int
+sort_next(record_sorter *sorter, uint64_t *entry)
+{
+    if (sorter->run_count == 0) {
+        if (sorter->next >= sorter->count) {
+            return 0;
+        }
+        *entry = sorter->sorted[sorter->next++];
+        return 1;
+    }
+    if (sorter->heap_count == 0) {
+        return 0;
+    }
+    sort_run_reader *reader = &sorter->readers[sorter->heap[0]];
+    *entry = reader->buffer[reader->position++];
+    if ((reader->position == reader->count) && !sort_run_fill(sorter, reader)) {
+        sorter->heap[0] = sorter->heap[--sorter->heap_count];
+    }
+    sort_heap_down(sorter, 0);
+    return 1;
+}
+
+/**
+ * Write entries to a new temporary file as a run.
+ */
+int
+sort_write_run(record_sorter *sorter, const uint64_t *entries, const size_t count)
+{
+    FILE *run = tmpfile();
+    if (run == NULL) {
+        fprintf(stderr, "Could not create sort run: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fwrite(entries, sizeof(uint64_t), count, run) != count) {
+        fprintf(stderr, "Could not write sort run: %s\n", strerror(errno));
+        fclose(run);
+        return EXIT_FAILURE;
+    }
+    sorter->runs[sorter->run_count++] = run;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Merge all runs into a single one.
+ */
+int
+sort_merge_runs(record_sorter *sorter)
+{
+    FILE *merged = tmpfile();
+    if (merged == NULL) {
+        fprintf(stderr, "Could not create sort run: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int exit_status = sort_merge_start(sorter);
+    uint64_t *buffer = sorter->scratch;
+    size_t count = 0;
+    uint64_t entry;
+    while ((exit_status == EXIT_SUCCESS) && sort_next(sorter, &entry)) {
+        buffer[count++] = entry;
+        if (count == sorter->allocated) {
+            if (fwrite(buffer, sizeof(uint64_t), count, merged) != count) {
+                exit_status = EXIT_FAILURE;
+            }
+            count = 0;
+        }
+    }
+    if ((exit_status == EXIT_SUCCESS)
+        && (fwrite(buffer, sizeof(uint64_t), count, merged) != count)) {
+        exit_status = EXIT_FAILURE;
+    }
+    if (sorter->failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    else if (exit_status != EXIT_SUCCESS) {
+        fprintf(stderr, "Could not write sort run: %s\n", strerror(errno));
+    }
+    for (int index = 0; index < sorter->run_count; ++index) {
+        fclose(sorter->runs[index]);
+    }
+    sorter->runs[0] = merged;
+    sorter->run_count = 1;
+    return exit_status;
+}
+
+/**
+ * Sort the entries collected and spill them as a run.
+ */
+int
+sort_spill(record_sorter *sorter)
+{
+    if ((sorter->run_count == SORT_MAX_RUNS)
+        && (sort_merge_runs(sorter) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    const uint64_t *sorted = sort_entries(sorter->entries, sorter->scratch,
+                                          sorter->count);
+    if (sort_write_run(sorter, sorted, sorter->count) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    sorter->count = 0;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Double the entry buffers, up to the memory limit. If there is not enough
+ * memory, the limit is lowered to the current size instead, so entries are
+ * spilled from then on.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the buffers could not grow
+ */
+int
+sort_grow(record_sorter *sorter)
+{
+    size_t allocated = sorter->allocated * 2;
+    if (allocated > sorter->capacity) {
+        allocated = sorter->capacity;
+    }
+    uint64_t *entries = realloc(sorter->entries, allocated * sizeof(uint64_t));
+    if (entries != NULL) {
+        sorter->entries = entries;
+    }
+    uint64_t *scratch = (entries != NULL)
+                        ? realloc(sorter->scratch, allocated * sizeof(uint64_t))
+                        : NULL;
+    if (scratch == NULL) {
+        sorter->capacity = sorter->allocated;
+        return EXIT_FAILURE;
+    }
+    sorter->scratch = scratch;
+    sorter->allocated = allocated;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Add a code to be sorted.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if spilling entries failed
+ */
+int
+sort_add(record_sorter *sorter, const revcode_32 revision_code)
+{
+    const revision_record record = {
+        revision_code, map_old_to_new(revision_code), 1, NULL, NULL
+    };
+    uint64_t key = 0;
+    for (int index = 0; index < sorter->fields.count; ++index) {
+        const field_descriptor *field = sorter->fields.fields[index];
+        key = (key << field_width(field)) | field_value(field, &record);
+    }
+    if ((sorter->count == sorter->allocated)
+        && ((sorter->allocated == sorter->capacity)
+            || (sort_grow(sorter) != EXIT_SUCCESS))
+        && (sort_spill(sorter) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    sorter->entries[sorter->count++] = (key << 32) | revision_code;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Sort the entries added, to be retrieved with sort_next().
+ */
+int
+sort_finish(record_sorter *sorter)
+{
+    sorter->next = 0;
+    if (sorter->run_count == 0) {
+        sorter->sorted = sort_entries(sorter->entries, sorter->scratch,
+                                      sorter->count);
+        return EXIT_SUCCESS;
+    }
+    if ((sorter->count > 0) && (sort_spill(sorter) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    return sort_merge_start(sorter);
+}
+
+/*
+ * Partitioned output (--partition): each record is written to a file
+ * whose path is given by a template over the record's fields, such as
+ * "fleet/{type}-{memory}.txt". Each partition has its own buffer, and
+ * output state (so CSV files each get a header). At most max_open files
+ * are kept open; when another is needed, the least recently used one is
+ * flushed and closed, to be reopened for appending when used again.
+ *
+ * As paths only depend on the code (fields with FIELD_NOT_CODE cannot be
+ * used), the partition of each code is cached.
+ */
+#define PARTITION_BUFFER_SIZE   (16 * 1024)
+#define PARTITION_DEFAULT_OPEN  64
+
+typedef struct {
+    char *path;
+    out_buffer out;             // File descriptor -1 while closed
+    unsigned long record_count; // Number of records output so far
+    int created;                // File created, to be appended to if closed
+    int newer;                  // Next more recently used open partition
+    int older;                  // Next less recently used open partition
+} output_partition;
+
+typedef struct {
+    revcode_32 code;
+    int partition;              // Index of the partition + 1, 0 if unused
+} partition_slot;
+
+typedef struct {
+    render_program program;     // Path template
+    const output_spec *spec;
+    output_partition *partitions;
+    int partition_count;
+    int partition_capacity;
+    partition_slot *slots;      // Partition by code
+    size_t slot_count;
+    size_t slots_used;
+    int max_open;
+    int open_count;
+    int newest;                 // Most recently used open partition, or -1
+    int oldest;                 // Least recently used open partition, or -1
+} partition_writer;
+
+/*
+ * Output sinks (--output format=path), replacing standard output: each
+ * record is decoded once and then output to every sink, in the sink's
+ * format and through its own buffer.
+ */
+#define MAX_OUTPUT_SINKS 8
+
+typedef struct {
+    output_spec spec;
+    const char *path;
+    out_buffer *out;            // &file_out, or &stdout_buffer for "-"
+    out_buffer file_out;
+    unsigned long record_count; // Number of records output so far
+} output_sink;
+
+typedef struct {
+    int count;
+    output_sink sinks[MAX_OUTPUT_SINKS];
+} output_sinks;
+
+/**
+ * Destination of decoded records: the output and its state.
+ *
+ * When collapsing runs, consecutive identical codes are counted as supplied,
+ * before any decoding, and only decoded and output once the run ends.
+ * When sorting, codes are collected and only output (sorted, and then
+ * collapsed) when finishing.
+ */
+typedef struct {
+    out_buffer *out;
+    const output_spec *spec;
+    unsigned long record_count; // Number of records output so far
+    revcode_32 run_code;        // Code of the current run
+    unsigned long run_length;   // Length of the current run, 0 if none
+    record_sorter *sorter;      // Sorter collecting codes, NULL if not sorting
+    partition_writer *partitions; // Partitions receiving records, or NULL
+    output_sinks *sinks;        // Sinks receiving records, or NULL
+} revision_output;
+
+void
+revision_output_init(revision_output *output,
+                     out_buffer *out,
+                     const output_spec *spec)
+{
+    output->out = out;
+    output->spec = spec;
+    output->record_count = 0;
+    output->run_code = 0;
+    output->run_length = 0;
+    output->sorter = NULL;
+    output->partitions = NULL;
+    output->sinks = NULL;
+}
+
+int
+emit_record(revision_output *output, const revision_record *record)
+{
+    const output_spec *spec = output->spec;
+    out_buffer *out = output->out;
+    switch (spec->format) {
+    case FORMAT_JSON:
+        emit_revision_json(out, &spec->selection, record, 0);
+        break;
+    case FORMAT_TEMPLATE:
+        emit_revision_template(out, &spec->program, record);
+        break;
+    case FORMAT_CSV:
+        emit_revision_csv(out, &spec->selection, record,
+                          output->record_count == 0);
+        break;
+    case FORMAT_BINARY:
+        emit_revision_binary(out, record);
+        break;
+    case FORMAT_DESCRIPTOR:
+        emit_revision_descriptor(out, record);
+        break;
+    default:
+        emit_revision_text(out, &spec->selection, record);
+        break;
+    }
+    output->record_count++;
+    return out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Output a record to an output buffer of which the caller keeps count.
+ *
+ * @param out The output buffer
+ * @param spec How to output the record
+ * @param record_count Number of records output to out so far, incremented
+ * @param record The record
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if output failed
+ */
+int
+emit_counted_record(out_buffer *out,
+                    const output_spec *spec,
+                    unsigned long *record_count,
+                    const revision_record *record)
+{
+    revision_output output;
+    revision_output_init(&output, out, spec);
+    output.record_count = *record_count;
+    const int exit_status = emit_record(&output, record);
+    *record_count = output.record_count;
+    return exit_status;
+}
+
+/**
+ * Set up partitioned output.
+ *
+ * @param writer The writer to set up
+ * @param template Template for the paths of partitions
+ * @param max_open Maximum number of files kept open
+ * @param spec How to output records to the partitions
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the template is not valid
+ */
+int
+partition_writer_init(partition_writer *writer,
+                      const char *template,
+                      const int max_open,
+                      const output_spec *spec)
+{
+    memset(writer, 0, sizeof(*writer));
+    if (compile_template(template, &writer->program) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    for (int index = 0; index < writer->program.count; ++index) {
+        const template_op *op = &writer->program.ops[index];
+        if ((op->kind != OP_LITERAL) && (op->field->flags & FIELD_NOT_CODE)) {
+            fprintf(stderr, "Partition paths can only depend on the code\n");
+            return EXIT_FAILURE;
+        }
+    }
+    writer->spec = spec;
+    writer->max_open = max_open;
+    writer->newest = -1;
+    writer->oldest = -1;
+    writer->slot_count = 256;
+    writer->slots = calloc(writer->slot_count, sizeof(partition_slot));
+    if (writer->slots == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+partition_slot *
+partition_find_slot(partition_slot *slots,
+                    const size_t slot_count,
+                    const revcode_32 code)
+{
+    size_t index = (code * 2654435761u) & (slot_count - 1);
+    while ((slots[index].partition != 0) && (slots[index].code != code)) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+void
+partition_unlink_lru(partition_writer *writer, const int index)
+{
+    output_partition *partition = &writer->partitions[index];
+    if (partition->newer >= 0) {
+        writer->partitions[partition->newer].older = partition->older;
+    }
+    else {
+        writer->newest = partition->older;
+    }
+    if (partition->older >= 0) {
+        writer->partitions[partition->older].newer = partition->newer;
+    }
+    else {
+        writer->oldest = partition->newer;
+    }
+}
+
+void
+partition_link_newest(partition_writer *writer, const int index)
+{
+    output_partition *partition = &writer->partitions[index];
+    partition->newer = -1;
+    partition->older = writer->newest;
+    if (writer->newest >= 0) {
+        writer->partitions[writer->newest].newer = index;
+    }
+    else {
+        writer->oldest = index;
+    }
+    writer->newest = index;
+}
+
+/**
+ * Flush and close the file of an open partition.
+ */
+int
+partition_close(partition_writer *writer, const int index)
+{
+    output_partition *partition = &writer->partitions[index];
+    const int exit_status = out_flush(&partition->out);
+    if (close(partition->out.fd) != 0) {
+        fprintf(stderr, "Could not write %s\n", partition->path);
+        partition->out.failed = 1;
+    }
+    partition->out.fd = -1;
+    partition_unlink_lru(writer, index);
+    writer->open_count--;
+    return (exit_status == EXIT_SUCCESS) && !partition->out.failed
+           ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Create the missing parent directories of a path.
+ */
+void
+make_parent_directories(const char *path)
+{
+    char parent[PATH_MAX];
+    strncpy(parent, path, sizeof(parent) - 1);
+    parent[sizeof(parent) - 1] = '\0';
+    for (char *p = strchr(parent + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(parent, 0777);
+        *p = '/';
+    }
+}
+
+/**
+ * Make a partition the most recently used one, opening its file if needed.
+ */
+int
+partition_use(partition_writer *writer, const int index)
+{
+    output_partition *partition = &writer->partitions[index];
+    if (partition->out.fd >= 0) {
+        if (writer->newest != index) {
+            partition_unlink_lru(writer, index);
+            partition_link_newest(writer, index);
+        }
+        return EXIT_SUCCESS;
+    }
+    if ((writer->open_count >= writer->max_open)
+        && (partition_close(writer, writer->oldest) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    int fd;
+    if (partition->created) {
+        fd = open(partition->path, O_WRONLY | O_APPEND);
+    }
+    else {
+        make_parent_directories(partition->path);
+        fd = open(partition->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", partition->path);
+        return EXIT_FAILURE;
+    }
+    partition->created = 1;
+    partition->out.fd = fd;
+    writer->open_count++;
+    partition_link_newest(writer, index);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Find the partition of a record, adding it if there is none yet.
+ *
+ * @returns The index of the partition, or -1 on failure
+ */
+int
+partition_find(partition_writer *writer, const revision_record *record)
+{
+    char path[PATH_MAX];
+    // Output buffer without file, failing if the path does not fit
+    out_buffer path_out = {
+        -1, 0, 0, sizeof(path) - 1, path, { NULL }, 0, 0, 0, NULL
+    };
+    emit_revision_template(&path_out, &writer->program, record);
+    if (path_out.failed || (path_out.used <= 1)) {
+        fprintf(stderr, "Invalid partition path for code %s\n",
+                hex_str(record->raw_code, path));
+        return -1;
+    }
+    path[path_out.used - 1] = '\0';    // Without the line end
+    for (int index = 0; index < writer->partition_count; ++index) {
+        if (strcmp(writer->partitions[index].path, path) == 0) {
+            return index;
+        }
+    }
+    if (writer->partition_count == writer->partition_capacity) {
+        const int capacity = (writer->partition_capacity > 0)
+                             ? writer->partition_capacity * 2 : 16;
+        output_partition *partitions
+            = realloc(writer->partitions, sizeof(output_partition) * (size_t) capacity);
+        if (partitions == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        writer->partitions = partitions;
+        writer->partition_capacity = capacity;
+    }
+    output_partition *partition = &writer->partitions[writer->partition_count];
+    const out_buffer out = {
+        -1, 0, 0, PARTITION_BUFFER_SIZE, malloc(PARTITION_BUFFER_SIZE),
+        { NULL }, 0, 0, 0, NULL
+    };
+    partition->path = strdup(path);
+    if ((out.data == NULL) || (partition->path == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        free(out.data);
+        free(partition->path);
+        return -1;
+    }
+    partition->out = out;
+    partition->record_count = 0;
+    partition->created = 0;
+    return writer->partition_count++;
+}
+
+/**
+ * Output a record to its partition.
+ */
+int
+partition_emit(partition_writer *writer, const revision_record *record)
+{
+    if ((writer->slots_used + 1) * 2 > writer->slot_count) {
+        const size_t slot_count = writer->slot_count * 2;
+        partition_slot *slots = calloc(slot_count, sizeof(partition_slot));
+        if (slots == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        for (size_t index = 0; index < writer->slot_count; ++index) {
+            if (writer->slots[index].partition != 0) {
+                *partition_find_slot(slots, slot_count, writer->slots[index].code)
+                    = writer->slots[index];
+            }
+        }
+        free(writer->slots);
+        writer->slots = slots;
+        writer->slot_count = slot_count;
+    }
+    partition_slot *slot = partition_find_slot(writer->slots, writer->slot_count,
+                                               record->raw_code);
+    if (slot->partition == 0) {
+        const int index = partition_find(writer, record);
+        if (index < 0) {
+            return EXIT_FAILURE;
+        }
+        slot->code = record->raw_code;
+        slot->partition = index + 1;
+        writer->slots_used++;
+    }
+    const int index = slot->partition - 1;
+    if (partition_use(writer, index) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    output_partition *partition = &writer->partitions[index];
+    return emit_counted_record(&partition->out, writer->spec,
+                               &partition->record_count, record);
+}
+
+/**
+ * Write all pending partition output and release the writer.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if any write failed
+ */
+int
+partition_writer_finish(partition_writer *writer)
+{
+    int exit_status = EXIT_SUCCESS;
+    for (int index = 0; index < writer->partition_count; ++index) {
+        output_partition *partition = &writer->partitions[index];
+        if (((partition->out.used > 0) || (partition->out.fd >= 0))
+            && ((partition_use(writer, index) != EXIT_SUCCESS)
+                || (partition_close(writer, index) != EXIT_SUCCESS))) {
+            exit_status = EXIT_FAILURE;
+        }
+        if (partition->out.failed) {
+            exit_status = EXIT_FAILURE;
+        }
+        free(partition->out.data);
+        free(partition->path);
+    }
+    free(writer->partitions);
+    free(writer->slots);
+    writer->partitions = NULL;
+    writer->partition_count = 0;
+    writer->slots = NULL;
+    return exit_status;
+}
+
+/**
+ * Set up an output sink.
+ *
+ * @param sink The sink to set up
+ * @param argument The sink as given, "format=path" ("-" for standard output)
+ * @param spec The output specification, of which the fields are used if
+ *             fields_selected is set
+ * @param fields_selected Whether the fields were selected explicitly
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+output_sink_open(output_sink *sink,
+                 const char *argument,
+                 const output_spec *spec,
+                 const int fields_selected)
+{
+    // Names of formats by output_format; templates are not available
+    static const char *format_names[] = {
+        "text", "json", NULL, "csv", "binary", "descriptor"
+    };
+    const char *separator = strchr(argument, '=');
+    if (separator == NULL) {
+        fprintf(stderr, "Output \"%s\" is not of the form format=path\n", argument);
+        return EXIT_FAILURE;
+    }
+    const size_t name_length = (size_t) (separator - argument);
+    size_t format = 0;
+    while ((format < ARRAY_CNT(format_names))
+           && ((format_names[format] == NULL)
+               || (strncmp(format_names[format], argument, name_length) != 0)
+               || (format_names[format][name_length] != '\0'))) {
+        ++format;
+    }
+    if (format == ARRAY_CNT(format_names)) {
+        fprintf(stderr, "Unknown output format \"%.*s\"\n",
+                (int) name_length, argument);
+        return EXIT_FAILURE;
+    }
+    sink->spec = *spec;
+    sink->spec.format = (output_format) format;
+    if (!fields_selected) {
+        select_default_fields(&sink->spec.selection,
+                              (sink->spec.format == FORMAT_JSON)
+                              || (sink->spec.format == FORMAT_CSV));
+    }
+    if (spec->collapse_runs) {
+        select_count_field(&sink->spec.selection);
+    }
+    sink->path = separator + 1;
+    sink->record_count = 0;
+    if (strcmp(sink->path, "-") == 0) {
+        sink->out = &stdout_buffer;
+        return EXIT_SUCCESS;
+    }
+    const int fd = open(sink->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", sink->path);
+        return EXIT_FAILURE;
+    }
+    const out_buffer out = {
+        fd, 0, 0, OUT_BUFFER_SIZE, malloc(OUT_BUFFER_SIZE),
+        { NULL }, 0, 0, 0, NULL
+    };
+    if (out.data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    sink->file_out = out;
+    sink->out = &sink->file_out;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Output a record to all sinks.
+ */
+int
+sinks_emit(output_sinks *sinks, const revision_record *record)
+{
+    int exit_status = EXIT_SUCCESS;
+    for (int index = 0; index < sinks->count; ++index) {
+        output_sink *sink = &sinks->sinks[index];
+        if (emit_counted_record(sink->out, &sink->spec, &sink->record_count,
+                                record) != EXIT_SUCCESS) {
+            exit_status = EXIT_FAILURE;
+        }
+    }
+    return exit_status;
+}
+
+/**
+ * Write all pending output of the sinks, and close their files.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if any write failed
+ */
+int
+output_sinks_finish(output_sinks *sinks)
+{
+    int exit_status = EXIT_SUCCESS;
+    for (int index = 0; index < sinks->count; ++index) {
+        output_sink *sink = &sinks->sinks[index];
+        if (sink->out != &sink->file_out) {
+            continue;           // Standard output is finished by main
+        }
+        if ((out_finish(sink->out) != EXIT_SUCCESS) | (close(sink->out->fd) != 0)) {
+            fprintf(stderr, "Could not write %s\n", sink->path);
+            exit_status = EXIT_FAILURE;
+        }
+        free(sink->out->data);
+    }
+    sinks->count = 0;
+    return exit_status;
+}
+
+/**
+ * Output a record to the partitions, sinks or output, as configured.
+ */
+int
+route_record(revision_output *output, const revision_record *record)
+{
+    if (output->partitions != NULL) {
+        return partition_emit(output->partitions, record);
+    }
+    if (output->sinks != NULL) {
+        return sinks_emit(output->sinks, record);
+    }
+    return emit_record(output, record);
+}
+
+int
+emit_revision(revision_output *output,
+              const revcode_32 revision_code,
+              const unsigned long count)
+{
+    const revision_record record = {
+        revision_code, map_old_to_new(revision_code), count, NULL, NULL
+    };
+    return route_record(output, &record);
+}
+
+/**
+ * Output the record for a revision code, or count it in the current run.
+ */
+int
+collapse_revision(revision_output *output, const revcode_32 revision_code)
+{
+    if (!output->spec->collapse_runs) {
+        return emit_revision(output, revision_code, 1);
+    }
+    if ((output->run_length > 0) && (revision_code == output->run_code)) {
+        output->run_length++;
+        return EXIT_SUCCESS;
+    }
+    int exit_status = EXIT_SUCCESS;
+    if (output->run_length > 0) {
+        exit_status = emit_revision(output, output->run_code, output->run_length);
+    }
+    output->run_code = revision_code;
+    output->run_length = 1;
+    return exit_status;
+}
+
+/**
+ * Output the record for a revision code, or collect it for sorting.
+ */
+int
+output_revision(revision_output *output, const revcode_32 revision_code)
+{
+    if (output->sorter != NULL) {
+        return sort_add(output->sorter, revision_code);
+    }
+    return collapse_revision(output, revision_code);
+}
+
+/**
+ * Output any pending run.
+ */
+int
+output_run(revision_output *output)
+{
+    int exit_status = EXIT_SUCCESS;
+    if (output->run_length > 0) {
+        exit_status = emit_revision(output, output->run_code, output->run_length);
+        output->run_length = 0;
+    }
+    return exit_status;
+}
+
+/**
+ * Output the header of a group of records with the same sort key, such as
+ * "== Type: 4B, Memory: 4GB ==".
+ */
+void
+emit_group_header(revision_output *output, const revcode_32 revision_code)
+{
+    const field_selection *fields = &output->sorter->fields;
+    const revision_record record = {
+        revision_code, map_old_to_new(revision_code), 1, NULL, NULL
+    };
+    char scratch[FIELD_SCRATCH_SIZE];
+
+    out_puts(output->out, "== ");
+    for (int index = 0; index < fields->count; ++index) {
+        const field_descriptor *field = fields->fields[index];
+        if (index > 0) {
+            out_puts(output->out, ", ");
+        }
+        out_puts(output->out, field->name);
+        out_puts(output->out, ": ");
+        out_puts(output->out, field_text(field, &record, scratch, sizeof(scratch)));
+    }
+    out_puts(output->out, " ==\n");
+}
+
+/**
+ * Output the codes collected for sorting, in order.
+ */
+int
+output_sorted(revision_output *output)
+{
+    record_sorter *sorter = output->sorter;
+    int exit_status = sort_finish(sorter);
+    uint64_t entry;
+    int first = 1;
+    uint32_t group = 0;
+    while ((exit_status == EXIT_SUCCESS) && sort_next(sorter, &entry)) {
+        const revcode_32 revision_code = (revcode_32) entry;
+        if (output->spec->group_headers
+            && (first || ((uint32_t) (entry >> 32) != group))) {
+            exit_status = output_run(output);
+            emit_group_header(output, revision_code);
+        }
+        first = 0;
+        group = (uint32_t) (entry >> 32);
+        if (collapse_revision(output, revision_code) != EXIT_SUCCESS) {
+            exit_status = EXIT_FAILURE;
+        }
+    }
+    if (sorter->failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    return exit_status;
+}
+
+/**
+ * Output any records not output yet: the codes collected for sorting, and
+ * any pending run. Partition and sink files are completed.
+ */
+int
+output_finish(revision_output *output)
+{
+    int exit_status = EXIT_SUCCESS;
+    if (output->sorter != NULL) {
+        exit_status = output_sorted(output);
+        record_sorter_free(output->sorter);
+        output->sorter = NULL;
+    }
+    if (output_run(output) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+    if (output->partitions != NULL) {
+        if (partition_writer_finish(output->partitions) != EXIT_SUCCESS) {
+            exit_status = EXIT_FAILURE;
+        }
+        output->partitions = NULL;
+    }
+    if (output->sinks != NULL) {
+        if (output_sinks_finish(output->sinks) != EXIT_SUCCESS) {
+            exit_status = EXIT_FAILURE;
+        }
+        output->sinks = NULL;
+    }
+    return exit_status;
+}
+
+revcode_32
+str_to_revision(const char *input)
+{
+    errno = 0;
+    char *endptr;
+    // On 32-bit systems long might be same size as int, but that would still be
+    // 32-bits, which is enough for our purpose
+    unsigned long value = strtoul(input, &endptr, 16);
+    if (errno == ERANGE) {
+        fprintf(stderr, "Revision code \"%s\" too large or too small\n", input);
+        exit(EXIT_FAILURE);
+    }
+    if ((errno != 0) || (endptr == input)) {
+        fprintf(stderr, "Could not parse revision code \"%s\"\n", input);
+        exit(EXIT_FAILURE);
+    }
+    if ((sizeof(long) > sizeof(int)) && (value > 0xFFFFFFFF)) {
+        fprintf(stderr, "Revision code \"%s\" (%lx) larger than 32 bits\n",
+                input,
+                value);
+        exit(EXIT_FAILURE);
+    }
+    return (revcode_32) value;
+}
+
+/**
+ * Parse a revision code without failing on invalid input.
+ *
+ * Unlike str_to_revision() the text need not be null terminated, and must
+ * consist of the code only.
+ *
+ * @param text The code, in hexadecimal with optional 0x or 0X prefix, or
+ *             in decimal
+ * @param length Length of the text
+ * @param base 16 or 10
+ * @param code Receives the code
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the text is not a valid code
+ */
+int
+parse_revision(const char *text,
+               size_t length,
+               const int base,
+               revcode_32 *code)
+{
+    if ((base == 16) && (length > 2) && (text[0] == '0')
+        && ((text[1] == 'x') || (text[1] == 'X'))) {
+        text += 2;
+        length -= 2;
+    }
+    if ((length == 0) || (length > 10)) {
+        return EXIT_FAILURE;
+    }
+    unsigned long long value = 0;
+    for (size_t index = 0; index < length; ++index) {
+        const char c = text[index];
+        unsigned int digit;
+        if ((c >= '0') && (c <= '9')) {
+            digit = (unsigned int) (c - '0');
+        }
+        else if ((base == 16) && (c >= 'a') && (c <= 'f')) {
+            digit = (unsigned int) (c - 'a' + 10);
+        }
+        else if ((base == 16) && (c >= 'A') && (c <= 'F')) {
+            digit = (unsigned int) (c - 'A' + 10);
+        }
+        else {
+            return EXIT_FAILURE;
+        }
+        value = value * (unsigned int) base + digit;
+    }
+    if (value > 0xFFFFFFFF) {
+        return EXIT_FAILURE;
+    }
+    *code = (revcode_32) value;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Input files. Input compressed with gzip is recognized by its magic
+ * bytes and, when built with zlib (-DPIREVISION_ZLIB, linking with -lz),
+ * decompressed by a thread of its own. The thread writes the data to a
+ * pipe, which is read in place of the file, so decompression overlaps
+ * with decoding. Bytes read from a pipe to recognize compression are
+ * returned first by input_read().
+ */
+#define GZIP_MAGIC_0    0x1F
+#define GZIP_MAGIC_1    0x8B
+#define INFLATE_CHUNK   (256 * 1024)
+
+typedef struct {
+    pthread_t thread;
+    int source_fd;              // Compressed data
+    int pipe_fd;                // Write end of the pipe to the reader
+    unsigned char prefix[2];    // Compressed data already read from source
+    size_t prefix_length;
+    const char *name;
+    int failed;                 // Set if decompression failed
+} input_inflater;
+
+typedef struct {
+    int fd;                     // Descriptor to read data from
+    const char *name;
+    unsigned char prefix[2];    // Data read, but not returned yet
+    size_t prefix_start;
+    size_t prefix_end;
+    input_inflater *inflater;   // Decompression thread, or NULL
+} input_file;
+
+#ifdef PIREVISION_ZLIB
+void *
+input_inflater_main(void *arg)
+{
+    input_inflater *inflater = arg;
+    unsigned char *in = malloc(INFLATE_CHUNK);
+    unsigned char *out = malloc(INFLATE_CHUNK);
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+    int failed = (in == NULL) || (out == NULL)
+                 || (inflateInit2(&stream, 15 + 16) != Z_OK);   // gzip only
+    if (!failed) {
+        memcpy(in, inflater->prefix, inflater->prefix_length);
+        stream.next_in = in;
+        stream.avail_in = (uInt) inflater->prefix_length;
+    }
+    int member_done = 0;
+    while (!failed) {
+        if (stream.avail_in == 0) {
+            const ssize_t count = read(inflater->source_fd, in, INFLATE_CHUNK);
+            if ((count < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (count <= 0) {
+                failed = (count < 0) || !member_done;
+                break;
+            }
+            stream.next_in = in;
+            stream.avail_in = (uInt) count;
+        }
+        if (member_done) {
+            // Concatenated gzip members decompress as a single stream
+            inflateReset(&stream);
+            member_done = 0;
+        }
+        stream.next_out = out;
+        stream.avail_out = INFLATE_CHUNK;
+        const int status = inflate(&stream, Z_NO_FLUSH);
+        if ((status != Z_OK) && (status != Z_STREAM_END) && (status != Z_BUF_ERROR)) {
+            failed = 1;
+            break;
+        }
+        member_done = (status == Z_STREAM_END);
+        // The reader can stop early, closing the pipe (SIGPIPE is blocked)
+        const unsigned char *data = out;
+        size_t length = INFLATE_CHUNK - stream.avail_out;
+        while (length > 0) {
+            const ssize_t written = write(inflater->pipe_fd, data, length);
+            if ((written < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (written < 0) {
+                break;
+            }
+            data += written;
+            length -= (size_t) written;
+        }
+        if (length > 0) {
+            break;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Could not decompress %s\n", inflater->name);
+    }
+    inflateEnd(&stream);
+    free(in);
+    free(out);
+    close(inflater->pipe_fd);
+    inflater->failed = failed;
+    return NULL;
+}
+
+/**
+ * Have compressed input decompressed by a thread, reading the result.
+ */
+int
+input_start_inflater(input_file *input)
+{
+    input_inflater *inflater = calloc(1, sizeof(input_inflater));
+    int fds[2];
+    if (inflater == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "Could not decompress %s\n", input->name);
+        free(inflater);
+        return EXIT_FAILURE;
+    }
+    inflater->source_fd = input->fd;
+    inflater->pipe_fd = fds[1];
+    memcpy(inflater->prefix, input->prefix, input->prefix_end);
+    inflater->prefix_length = input->prefix_end;
+    inflater->name = input->name;
+
+    sigset_t signals;
+    sigset_t old_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+    const int error = pthread_create(&inflater->thread, NULL,
+                                     input_inflater_main, inflater);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Could not start decompression thread\n");
+        close(fds[0]);
+        close(fds[1]);
+        free(inflater);
+        return EXIT_FAILURE;
+    }
+    input->fd = fds[0];
+    input->prefix_start = 0;
+    input->prefix_end = 0;
+    input->inflater = inflater;
+    return EXIT_SUCCESS;
+}
+#endif
+
+/**
+ * Wait for decompression of an input to complete, once all has been read.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if decompression failed
+ */
+int
+input_finish(input_file *input)
+{
+    input_inflater *inflater = input->inflater;
+    if (inflater == NULL) {
+        return EXIT_SUCCESS;
+    }
+    pthread_join(inflater->thread, NULL);
+    const int failed = inflater->failed;
+    if (inflater->source_fd != STDIN_FILENO) {
+        close(inflater->source_fd);
+    }
+    free(inflater);
+    input->inflater = NULL;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Open an input file, decompressing it if needed.
+ *
+ * @param input The input to initialize
+ * @param path Name of the file to read, or "-" for standard input
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+input_open(input_file *input, const char *path)
+{
+    input->name = path;
+    input->prefix_start = 0;
+    input->prefix_end = 0;
+    input->inflater = NULL;
+    input->fd = (strcmp(path, "-") == 0) ? STDIN_FILENO
+                                         : open(path, O_RDONLY);
+    if (input->fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return EXIT_FAILURE;
+    }
+    unsigned char magic[2];
+    size_t magic_length = 0;
+    const off_t offset = lseek(input->fd, 0, SEEK_CUR);
+    if (offset >= 0) {
+        const ssize_t count = pread(input->fd, magic, sizeof(magic), offset);
+        magic_length = (count > 0) ? (size_t) count : 0;
+    }
+    else {
+        // Not seekable: keep the bytes read, to be returned by input_read()
+        while (magic_length < sizeof(magic)) {
+            const ssize_t count = read(input->fd, magic + magic_length,
+                                       sizeof(magic) - magic_length);
+            if ((count < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            magic_length += (size_t) count;
+        }
+        memcpy(input->prefix, magic, magic_length);
+        input->prefix_end = magic_length;
+    }
+    if ((magic_length < 2) || (magic[0] != GZIP_MAGIC_0) || (magic[1] != GZIP_MAGIC_1)) {
+        return EXIT_SUCCESS;
+    }
+#ifdef PIREVISION_ZLIB
+    if (input_start_inflater(input) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+#else
+    fprintf(stderr,
+            "%s is compressed, which requires building with -DPIREVISION_ZLIB -lz\n",
+            path);
+#endif
+    if (input->fd != STDIN_FILENO) {
+        close(input->fd);
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Read (decompressed) data from an input, as read() does.
+ */
+ssize_t
+input_read(input_file *input, void *buffer, const size_t size)
+{
+    if (input->prefix_start < input->prefix_end) {
+        size_t count = input->prefix_end - input->prefix_start;
+        if (count > size) {
+            count = size;
+        }
+        memcpy(buffer, input->prefix + input->prefix_start, count);
+        input->prefix_start += count;
+        return (ssize_t) count;
+    }
+    return read(input->fd, buffer, size);
+}
+
+/**
+ * Close an input, which need not have been read completely.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if decompression failed
+ */
+int
+input_close(input_file *input)
+{
+    // Closing the pipe first makes a decompression thread stop writing
+    if (input->fd != STDIN_FILENO) {
+        close(input->fd);
+    }
+    input->fd = -1;
+    return input_finish(input);
+}
+
+/**
+ * Read all (decompressed) data of an input file into memory.
+ *
+ * @param path Name of the file to read, or "-" for standard input
+ * @param data Receives the data, null terminated, to be freed by the caller
+ * @param length Receives the number of bytes read
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+input_read_all(const char *path, char **data, size_t *length)
+{
+    input_file input;
+    if (input_open(&input, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    size_t size = 16 * 1024;
+    size_t used = 0;
+    char *buffer = malloc(size);
+    int exit_status = EXIT_SUCCESS;
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit_status = EXIT_FAILURE;
+    }
+    while (exit_status == EXIT_SUCCESS) {
+        if (used + 1 >= size) {
+            char *grown = realloc(buffer, size * 2);
+            if (grown == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            buffer = grown;
+            size *= 2;
+        }
+        // No table lookups are in progress here, so tables can be replaced
+        const int paused = tables_pause();
+        const ssize_t count = input_read(&input, buffer + used, size - used - 1);
+        tables_resume(paused);
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (count < 0) {
+            fprintf(stderr, "Could not read %s\n", path);
+            exit_status = EXIT_FAILURE;
+        }
+        if (count <= 0) {
+            break;
+        }
+        used += (size_t) count;
+    }
+    if (input_close(&input) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+    if (exit_status != EXIT_SUCCESS) {
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    buffer[used] = '\0';
+    *data = buffer;
+    *length = used;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Whether a cpuinfo line starts with a key.
+ */
+int
+cpuinfo_key(const char *line,
+            const char *line_end,
+            const char *key,
+            const size_t key_length)
+{
+    return ((size_t) (line_end - line) > key_length)
+           && (memcmp(line, key, key_length) == 0)
+           && ((line[key_length] == ' ') || (line[key_length] == '\t')
+               || (line[key_length] == ':'));
+}
+
+/**
+ * Extract the values of keys from cpuinfo data, in a single pass.
+ *
+ * Lines have the form "key : value", with the key at the start of the line
+ * followed by any number of tabs or spaces. Scanning stops as soon as all
+ * keys wanted have been found; only their first occurrence counts. Values
+ * are stored without surrounding white space, truncated if needed.
+ *
+ * @param data The data, which need not be null terminated
+ * @param length Length of the data
+ * @param wanted CPUINFO_xxx flags of the keys to extract
+ * @param values Receives the values, empty for keys not found
+ * @returns EXIT_SUCCESS if all keys wanted were found, else EXIT_FAILURE
+ */
+int
+parse_cpuinfo(const char *data,
+              const size_t length,
+              const int wanted,
+              cpuinfo_values *values)
+{
+    const char *end = data + length;
+    values->found = 0;
+    values->revision[0] = '\0';
+    values->serial[0] = '\0';
+    values->model[0] = '\0';
+    values->hardware[0] = '\0';
+    for (const char *line = data;
+         (line < end) && ((values->found & wanted) != wanted);) {
+        const char *line_end = memchr(line, '\n', (size_t) (end - line));
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        int key = 0;
+        size_t key_length = 0;
+        char *value = NULL;
+        // Dispatch on the first character, so most lines are skipped at once
+        switch (line[0]) {
+        case 'R':
+            key = CPUINFO_REVISION;
+            key_length = 8;
+            value = values->revision;
+            break;
+        case 'S':
+            key = CPUINFO_SERIAL;
+            key_length = 6;
+            value = values->serial;
+            break;
+        case 'M':
+            key = CPUINFO_MODEL;
+            key_length = 5;
+            value = values->model;
+            break;
+        case 'H':
+            key = CPUINFO_HARDWARE;
+            key_length = 8;
+            value = values->hardware;
+            break;
+        default:
+            break;
+        }
+        static const char *key_names[] = {
+            NULL, "Revision", "Serial", NULL, "Model", NULL, NULL, NULL, "Hardware"
+        };
+        if ((key & wanted & ~values->found)
+            && cpuinfo_key(line, line_end, key_names[key], key_length)) {
+            const char *p = line + key_length;
+            while ((p < line_end) && ((*p == ' ') || (*p == '\t'))) {
+                ++p;
+            }
+            if ((p < line_end) && (*p == ':')) {
+                ++p;
+                while ((p < line_end) && ((*p == ' ') || (*p == '\t'))) {
+                    ++p;
+                }
+                const char *value_end = line_end;
+                while ((value_end > p)
+                       && ((value_end[-1] == ' ') || (value_end[-1] == '\t')
+                           || (value_end[-1] == '\r'))) {
+                    --value_end;
+                }
+                size_t value_length = (size_t) (value_end - p);
+                if (value_length >= CPUINFO_VALUE_SIZE) {
+                    value_length = CPUINFO_VALUE_SIZE - 1;
+                }
+                memcpy(value, p, value_length);
+                value[value_length] = '\0';
+                values->found |= key;
+            }
+        }
+        line = line_end + 1;
+    }
+    return ((values->found & wanted) == wanted) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Extract the values of keys from a cpuinfo file.
+ *
+ * @param path Name of the cpuinfo file, usually "/proc/cpuinfo"
+ * @param wanted CPUINFO_xxx flags of the keys to extract
+ * @param values Receives the values, empty for keys not found
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the file could not be read
+ */
+int
+read_cpuinfo(const char *path, const int wanted, cpuinfo_values *values)
+{
+    char *data;
+    size_t length;
+    if (input_read_all(path, &data, &length) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    parse_cpuinfo(data, length, wanted, values);
+    free(data);
+    return EXIT_SUCCESS;
+}
+
+int
+read_proc_cpuinfo(const int wanted, cpuinfo_values *values)
+{
+    return read_cpuinfo("/proc/cpuinfo", wanted, values);
+}
+
+/**
+ * CPUINFO_xxx flag of the cpuinfo value a field outputs, 0 if none.
+ */
+int
+field_cpuinfo_key(const field_descriptor *field)
+{
+    if (field->render == render_serial) {
+        return CPUINFO_SERIAL;
+    }
+    if (field->render == render_model) {
+        return CPUINFO_MODEL;
+    }
+    if (field->render == render_hardware) {
+        return CPUINFO_HARDWARE;
+    }
+    return 0;
+}
+
+int
+program_cpuinfo_keys(const render_program *program)
+{
+    int keys = 0;
+    for (int index = 0; index < program->count; ++index) {
+        if (program->ops[index].kind == OP_FIELD) {
+            keys |= field_cpuinfo_key(program->ops[index].field);
+        }
+    }
+    return keys;
+}
+
+int
+spec_cpuinfo_keys(const output_spec *spec)
+{
+    if (spec->format == FORMAT_TEMPLATE) {
+        return program_cpuinfo_keys(&spec->program);
+    }
+    int keys = 0;
+    for (int index = 0; index < spec->selection.count; ++index) {
+        keys |= field_cpuinfo_key(spec->selection.fields[index]);
+    }
+    return keys;
+}
+
+/**
+ * Keys to extract from cpuinfo data for an output: the revision, and the
+ * values output by the selected fields and templates, of every sink.
+ *
+ * @returns CPUINFO_xxx flags
+ */
+int
+output_cpuinfo_keys(const revision_output *output)
+{
+    if ((output->sorter != NULL) || output->spec->collapse_runs) {
+        return CPUINFO_REVISION;        // Only the code is kept
+    }
+    int keys = CPUINFO_REVISION | spec_cpuinfo_keys(output->spec);
+    if (output->sinks != NULL) {
+        for (int index = 0; index < output->sinks->count; ++index) {
+            keys |= spec_cpuinfo_keys(&output->sinks->sinks[index].spec);
+        }
+    }
+    return keys;
+}
+
+/**
+ * Output the record of a cpuinfo file, named by its path.
+ */
+int
+process_cpuinfo_file(const char *path, revision_output *output)
+{
+    cpuinfo_values values;
+    if (read_cpuinfo(path, output_cpuinfo_keys(output), &values) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    const revcode_32 revision_code = str_to_revision(values.revision);
+    if ((output->sorter != NULL) || output->spec->collapse_runs) {
+        // Records sorted or collapsed only keep their code
+        return output_revision(output, revision_code);
+    }
+    const revision_record record = {
+        revision_code, map_old_to_new(revision_code), 1, path, &values
+    };
+    return route_record(output, &record);
+}
+
+int
+process_proc_cpuinfo(revision_output *output)
+{
+    return process_cpuinfo_file("/proc/cpuinfo", output);
+}
+
+/*
+ * Line oriented input is read in large blocks into a buffer, from which
+ * lines are returned in place. The buffer only grows if a single line does
+ * not fit.
+ */
+#define LINE_READER_SIZE (1024 * 1024)
+
+typedef struct {
+    input_file input;
+    const char *name;           // Name used in error messages
+    char *buffer;
+    size_t size;                // Allocated size of buffer
+    size_t start;               // Start of data not yet returned
+    size_t end;                 // End of data read into buffer
+    int eof;                    // Set when no more data can be read
+    int failed;                 // Set when reading failed
+} line_reader;
+
+/**
+ * Open a line reader.
+ *
+ * @param reader The reader to initialize
+ * @param path Name of the file to read, or "-" for standard input
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+line_reader_open(line_reader *reader, const char *path)
+{
+    reader->name = path;
+    reader->size = LINE_READER_SIZE;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    reader->failed = 0;
+    if (input_open(&reader->input, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    reader->buffer = malloc(reader->size);
+    if (reader->buffer == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        input_close(&reader->input);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void
+line_reader_close(line_reader *reader)
+{
+    input_close(&reader->input);
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+/**
+ * Read more data into the reader's buffer.
+ *
+ * Data not yet consumed is moved to the start of the buffer first, and the
+ * buffer is grown if it is full. One byte is always kept free, so a
+ * terminating null character can be added after the data.
+ *
+ * @param reader The reader
+ * @returns Number of bytes added, 0 at end of input or on failure
+ */
+size_t
+line_reader_fill(line_reader *reader)
+{
+    if (reader->eof) {
+        return 0;
+    }
+    if (reader->start > 0) {
+        memmove(reader->buffer,
+                reader->buffer + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end + 1 >= reader->size) {
+        char *buffer = realloc(reader->buffer, reader->size * 2);
+        if (buffer == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            reader->failed = 1;
+            reader->eof = 1;
+            return 0;
+        }
+        reader->buffer = buffer;
+        reader->size *= 2;
+    }
+    for (;;) {
+        // No table lookups are in progress here, so tables can be replaced
+        const int paused = tables_pause();
+        const ssize_t count = input_read(&reader->input,
+                                         reader->buffer + reader->end,
+                                         reader->size - reader->end - 1);
+        tables_resume(paused);
+        if (count > 0) {
+            reader->end += (size_t) count;
+            return (size_t) count;
+        }
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (count < 0) {
+            fprintf(stderr, "Could not read %s\n", reader->name);
+            reader->failed = 1;
+        }
+        else if (input_finish(&reader->input) != EXIT_SUCCESS) {
+            reader->failed = 1;
+        }
+        reader->eof = 1;
+        return 0;
+    }
+}
+
+/**
+ * Return the next line, without its line terminator.
+ *
+ * The line is null terminated and remains valid until the next call.
+ *
+ * @param reader The reader
+ * @param length Receives the length of the line
+ * @returns The line, or NULL at end of input
+ */
+char *
+line_reader_next(line_reader *reader, size_t *length)
+{
+    size_t scanned = reader->start;
+    for (;;) {
+        char *newline = memchr(reader->buffer + scanned,
+                               '\n',
+                               reader->end - scanned);
+        if ((newline != NULL)
+            || (reader->eof && (reader->end > reader->start))) {
+            char *line = reader->buffer + reader->start;
+            char *line_end = (newline != NULL) ? newline
+                                               : reader->buffer + reader->end;
+            reader->start = (size_t) (line_end - reader->buffer)
+                            + (newline != NULL);
+            if ((line_end > line) && (line_end[-1] == '\r')) {
+                --line_end;
+            }
+            *line_end = '\0';
+            *length = (size_t) (line_end - line);
+            return line;
+        }
+        if (reader->eof) {
+            return NULL;
+        }
+        scanned = reader->end - reader->start;
+        line_reader_fill(reader);
+        scanned += reader->start;
+    }
+}
+
+/**
+ * Process a single code, or a cpuinfo file if the entry is not entirely a
+ * hexadecimal code (so "cpuinfo-host1" is a file, not code 0xC).
+ */
+int
+process_list_entry(const char *entry, revision_output *output)
+{
+    revcode_32 code;
+    if (parse_revision(entry, strlen(entry), 16, &code) == EXIT_SUCCESS) {
+        return output_revision(output, code);
+    }
+    return process_cpuinfo_file(entry, output);
+}
+
+/**
+ * Process a file listing one entry per line.
+ *
+ * Leading and trailing white space is ignored, as are empty lines and lines
+ * starting with '#'.
+ *
+ * @param path Name of the list file, or "-" for standard input
+ * @param paths_only If set, all entries are cpuinfo files, otherwise entries
+ *                   are handled as by process_list_entry()
+ * @param output Destination of the decoded codes
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_list_file(const char *path,
+                  const int paths_only,
+                  revision_output *output)
+{
+    line_reader reader;
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    size_t length;
+    char *line;
+    while ((exit_status == EXIT_SUCCESS)
+           && ((line = line_reader_next(&reader, &length)) != NULL)) {
+        while ((length > 0) && ((line[length - 1] == ' ')
+                                || (line[length - 1] == '\t'))) {
+            line[--length] = '\0';
+        }
+        while ((*line == ' ') || (*line == '\t')) {
+            ++line;
+        }
+        if ((*line == '\0') || (*line == '#')) {
+            continue;
+        }
+        exit_status = paths_only ? process_cpuinfo_file(line, output)
+                                 : process_list_entry(line, output);
+    }
+    if (reader.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+    return exit_status;
+}
+
+/**
+ * Process all arguments as revision codes.
+ *
+ * An argument starting with '@' names a list file with more entries,
+ * and an argument that is not a hexadecimal code names a cpuinfo file.
+ */
+int
+process_rev_codes(const char **codes,
+                  const int code_count,
+                  revision_output *output)
+{
+    int exit_status = EXIT_SUCCESS;
+
+    for (int index = 0;
+         index < code_count && (exit_status == 0); ++index) {
+        if (codes[index][0] == '@') {
+            exit_status = process_list_file(codes[index] + 1, 0, output);
+        }
+        else {
+            exit_status = process_list_entry(codes[index], output);
+        }
+    }
+    return exit_status;
+}
+
+/*
+ * Raw binary input consists of consecutive 32-bit revision codes, in either
+ * little or big endian byte order, without any separators.
+ */
+#define BINARY_READ_SIZE (1024 * 1024)
+
+revcode_32
+load_revcode(const unsigned char *bytes, const int big_endian)
+{
+    if (big_endian) {
+        return ((revcode_32) bytes[0] << 24) | ((revcode_32) bytes[1] << 16)
+               | ((revcode_32) bytes[2] << 8) | (revcode_32) bytes[3];
+    }
+    return ((revcode_32) bytes[3] << 24) | ((revcode_32) bytes[2] << 16)
+           | ((revcode_32) bytes[1] << 8) | (revcode_32) bytes[0];
+}
+
+int
+process_binary_block(const unsigned char *data,
+                     const size_t length,
+                     const int big_endian,
+                     revision_output *output)
+{
+    int exit_status = EXIT_SUCCESS;
+    for (size_t offset = 0;
+         (offset + 4 <= length) && (exit_status == EXIT_SUCCESS);
+         offset += 4) {
+        exit_status = output_revision(output,
+                                      load_revcode(data + offset, big_endian));
+    }
+    return exit_status;
+}
+
+/**
+ * Process a file of raw binary revision codes.
+ *
+ * Regular files are memory mapped, anything else (such as a pipe) is read
+ * in large blocks.
+ *
+ * @param path Name of the file, or "-" for standard input
+ * @param big_endian Whether the codes are stored big endian
+ * @param output Destination of the decoded codes
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_binary_file(const char *path,
+                    const int big_endian,
+                    revision_output *output)
+{
+    input_file input;
+    if (input_open(&input, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    const int fd = input.fd;
+
+    int exit_status = EXIT_SUCCESS;
+    size_t total = 0;
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        total = (size_t) st.st_size;
+        void *data = mmap(NULL, total, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Could not map %s\n", path);
+            exit_status = EXIT_FAILURE;
+        }
+        else {
+            madvise(data, total, MADV_SEQUENTIAL);
+            exit_status = process_binary_block(data, total, big_endian, output);
+            munmap(data, total);
+        }
+    }
+    else {
+        unsigned char *buffer = malloc(BINARY_READ_SIZE);
+        size_t pending = 0;     // Bytes of an incomplete code carried over
+        if (buffer == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit_status = EXIT_FAILURE;
+        }
+        while (exit_status == EXIT_SUCCESS) {
+            const int paused = tables_pause();
+            const ssize_t count = input_read(&input,
+                                             buffer + pending,
+                                             BINARY_READ_SIZE - pending);
+            tables_resume(paused);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "Could not read %s\n", path);
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            if (count == 0) {
+                break;
+            }
+            total += (size_t) count;
+            const size_t available = pending + (size_t) count;
+            const size_t complete = available & ~(size_t) 3;
+            exit_status = process_binary_block(buffer, complete,
+                                               big_endian, output);
+            pending = available - complete;
+            memmove(buffer, buffer + complete, pending);
+        }
+        free(buffer);
+    }
+    if (input_close(&input) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+    if ((exit_status == EXIT_SUCCESS) && ((total % 4) != 0)) {
+        fprintf(stderr, "%s: ignored incomplete code at end of input\n", path);
+        exit_status = EXIT_FAILURE;
+    }
+    return exit_status;
+}
+
+/*
+ * Tar archives of cpuinfo files (--tar), as ustar, pax or GNU tar writes
+ * them, are read as a stream: each header block is followed by the
+ * member's data, padded to whole blocks. Regular members are read into
+ * memory and the revision code extracted from them, and the record of a
+ * member is named by its path. Long paths are taken from pax extended
+ * headers or GNU long name members preceding the member.
+ */
+#define TAR_BLOCK_SIZE      512
+#define TAR_MAX_MEMBER      (1024 * 1024)   // Larger members are skipped
+
+/**
+ * Read as much of the requested data as the input has, letting the tables
+ * be replaced while waiting for it.
+ *
+ * @returns The number of bytes read, less than length only at end of
+ *          input, or -1 if reading failed
+ */
+ssize_t
+input_read_full(input_file *input, void *buffer, const size_t length)
+{
+    size_t total = 0;
+    while (total < length) {
+        const int paused = tables_pause();
+        const ssize_t count = input_read(input, (char *) buffer + total,
+                                         length - total);
+        tables_resume(paused);
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (count < 0) {
+            return -1;
+        }
+        if (count == 0) {
+            break;
+        }
+        total += (size_t) count;
+    }
+    return (ssize_t) total;
+}
+
+/**
+ * Return the value of a numeric tar header field: octal text, or a binary
+ * (base-256) big endian number if the high bit of the first byte is set.
+ */
+unsigned long long
+tar_number(const unsigned char *field, const size_t length)
+{
+    unsigned long long value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for (size_t index = 1; index < length; ++index) {
+            value = (value << 8) | field[index];
+        }
+        return value;
+    }
+    size_t index = 0;
+    while ((index < length) && ((field[index] == ' ') || (field[index] == '\0'))) {
+        ++index;
+    }
+    for (; (index < length) && (field[index] >= '0') && (field[index] <= '7'); ++index) {
+        value = (value << 3) | (unsigned int) (field[index] - '0');
+    }
+    return value;
+}
+
+/**
+ * Check the checksum of a tar header block.
+ */
+int
+tar_header_valid(const unsigned char *header)
+{
+    unsigned long sum = 0;
+    for (int index = 0; index < TAR_BLOCK_SIZE; ++index) {
+        // The checksum field itself counts as spaces
+        sum += ((index >= 148) && (index < 156)) ? ' ' : header[index];
+    }
+    return sum == tar_number(header + 148, 8);
+}
+
+/**
+ * Find the path in the records of a pax extended header, such as
+ * "30 path=devices/abc/cpuinfo\n".
+ *
+ * @returns The path, null terminated in place, or NULL if there is none
+ */
+char *
+tar_pax_path(char *data, const size_t length)
+{
+    size_t offset = 0;
+    while (offset < length) {
+        char *end;
+        const unsigned long record_length = strtoul(data + offset, &end, 10);
+        if ((record_length == 0) || (record_length > length - offset) || (*end != ' ')) {
+            return NULL;
+        }
+        char *record_end = data + offset + record_length - 1;     // The '\n'
+        if ((strncmp(end + 1, "path=", 5) == 0) && (end + 6 <= record_end)) {
+            *record_end = '\0';
+            return end + 6;
+        }
+        offset += record_length;
+    }
+    return NULL;
+}
+
+/**
+ * Output a record for each cpuinfo file in a tar archive.
+ *
+ * @param path Name of the archive, or "-" for standard input
+ * @param output Destination of the records
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the archive could not be read
+ */
+int
+process_tar_file(const char *path, revision_output *output)
+{
+    input_file input;
+    if (input_open(&input, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    unsigned char header[TAR_BLOCK_SIZE];
+    char discard[TAR_BLOCK_SIZE];
+    char *data = malloc(TAR_MAX_MEMBER + 1);
+    char *long_path = NULL;         // Path for the next member, if any
+    char member_path[256 + 100];
+    unsigned long skipped = 0;      // Members without valid revision code
+    const int cpuinfo_keys = output_cpuinfo_keys(output);
+    int exit_status = EXIT_SUCCESS;
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit_status = EXIT_FAILURE;
+    }
+    while (exit_status == EXIT_SUCCESS) {
+        const ssize_t count = input_read_full(&input, header, sizeof(header));
+        if ((count == 0) || ((count == TAR_BLOCK_SIZE) && (header[0] == '\0'))) {
+            break;                  // End of archive
+        }
+        if (count != TAR_BLOCK_SIZE) {
+            fprintf(stderr, "%s: truncated tar archive\n", path);
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        if (!tar_header_valid(header)) {
+            fprintf(stderr, "%s: not a valid tar archive\n", path);
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        const char type = (char) header[156];
+        const unsigned long long size = tar_number(header + 124, 12);
+        const unsigned long long padded
+            = (size + TAR_BLOCK_SIZE - 1) & ~(unsigned long long) (TAR_BLOCK_SIZE - 1);
+        const int regular = (type == '0') || (type == '\0') || (type == '7');
+        const int wanted = regular || (type == 'L') || (type == 'x');
+
+        // Read the data of wanted members, skip the rest
+        size_t length = 0;
+        unsigned long long remaining = padded;
+        while (remaining > 0) {
+            char *target = data + length;
+            size_t chunk = TAR_MAX_MEMBER - length;
+            if (!wanted || (size > TAR_MAX_MEMBER) || (chunk == 0)) {
+                target = discard;
+                chunk = sizeof(discard);
+            }
+            if (chunk > remaining) {
+                chunk = (size_t) remaining;
+            }
+            const ssize_t read_count = input_read_full(&input, target, chunk);
+            if (read_count != (ssize_t) chunk) {
+                fprintf(stderr, "%s: truncated tar archive\n", path);
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            if (target != discard) {
+                length += chunk;
+            }
+            remaining -= chunk;
+        }
+        if (exit_status != EXIT_SUCCESS) {
+            break;
+        }
+        if (length > size) {
+            length = (size_t) size;     // Without padding
+        }
+        data[length] = '\0';
+        if ((type == 'L') || (type == 'x')) {
+            free(long_path);
+            long_path = NULL;
+            const char *name = (type == 'L') ? data : tar_pax_path(data, length);
+            if ((name != NULL) && (size <= TAR_MAX_MEMBER)) {
+                long_path = strdup(name);
+            }
+            continue;
+        }
+        if (!regular) {
+            free(long_path);
+            long_path = NULL;
+            continue;
+        }
+
+        const char *name = long_path;
+        if (name == NULL) {
+            // ustar splits long paths into a prefix and a name
+            const char *prefix = (memcmp(header + 257, "ustar", 5) == 0)
+                                 ? (const char *) header + 345 : "";
+            snprintf(member_path, sizeof(member_path), "%.*s%s%.*s",
+                     (int) strnlen(prefix, 155), prefix,
+                     (prefix[0] != '\0') ? "/" : "",
+                     (int) strnlen((const char *) header, 100), (const char *) header);
+            name = member_path;
+        }
+        cpuinfo_values values;
+        revcode_32 code = 0;
+        revcode_32 normalized = 0;
+        parse_cpuinfo(data, length, cpuinfo_keys, &values);
+        if ((size > TAR_MAX_MEMBER)
+            || !(values.found & CPUINFO_REVISION)
+            || (parse_revision(values.revision, strlen(values.revision), 16,
+                               &code) != EXIT_SUCCESS)
+            || (normalize_revision(code, &normalized) != EXIT_SUCCESS)) {
+            skipped++;
+        }
+        else if ((output->sorter != NULL) || output->spec->collapse_runs) {
+            // Records sorted or collapsed only keep their code
+            exit_status = output_revision(output, code);
+        }
+        else {
+            const revision_record record = { code, normalized, 1, name, &values };
+            exit_status = route_record(output, &record);
+        }
+        free(long_path);
+        long_path = NULL;
+    }
+    if (skipped > 0) {
+        fprintf(stderr, "%s: %lu members without valid revision code\n",
+                path, skipped);
+    }
+    free(long_path);
+    free(data);
+    if (input_close(&input) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+    return exit_status;
+}
+
+/**
+ * Skip white space in a JSON text.
+ */
+const char *
+json_skip_space(const char *p, const char *end)
+{
+    while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) {
+        ++p;
+    }
+    return p;
+}
+
+/**
+ * Skip a JSON string, starting at its opening quote.
+ *
+ * @returns Pointer just past the closing quote, or NULL if unterminated
+ */
+const char *
+json_skip_string(const char *p, const char *end)
+{
+    for (++p; p < end; ++p) {
+        if (*p == '\\') {
+            ++p;
+        }
+        else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the value of a top level member in a single line JSON object.
+ *
+ * This is a lightweight scanner, not a parser: it only tracks strings and
+ * nesting depth, and does not validate the object.
+ *
+ * @param line The line holding the object
+ * @param end End of the line
+ * @param key The member name to look for
+ * @param value Receives the start of the member's value
+ * @param value_end Receives the end of the member's value (for a string,
+ *                  the value excludes the quotes)
+ * @param is_string Receives whether the value is a string
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if there is no such member
+ */
+int
+json_find_member(const char *line,
+                 const char *end,
+                 const char *key,
+                 const char **value,
+                 const char **value_end,
+                 int *is_string)
+{
+    const size_t key_length = strlen(key);
+    int depth = 0;
+    const char *p = line;
+    while (p < end) {
+        const char c = *p;
+        if (c == '"') {
+            const char *string = p;
+            p = json_skip_string(p, end);
+            if (p == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (depth != 1) {
+                continue;
+            }
+            const char *colon = json_skip_space(p, end);
+            if ((colon == end) || (*colon != ':')) {
+                continue;       // A value, not a key
+            }
+            if (((size_t) (p - string - 2) != key_length)
+                || (memcmp(string + 1, key, key_length) != 0)) {
+                p = colon + 1;
+                continue;
+            }
+            const char *start = json_skip_space(colon + 1, end);
+            if ((start < end) && (*start == '"')) {
+                const char *stop = json_skip_string(start, end);
+                if (stop == NULL) {
+                    return EXIT_FAILURE;
+                }
+                *value = start + 1;
+                *value_end = stop - 1;
+                *is_string = 1;
+                return EXIT_SUCCESS;
+            }
+            const char *stop = start;
+            while ((stop < end) && (*stop != ',') && (*stop != '}')
+                   && (*stop != ' ') && (*stop != '\t')) {
+                ++stop;
+            }
+            *value = start;
+            *value_end = stop;
+            *is_string = 0;
+            return EXIT_SUCCESS;
+        }
+        if ((c == '{') || (c == '[')) {
+            ++depth;
+        }
+        else if ((c == '}') || (c == ']')) {
+            --depth;
+        }
+        ++p;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Copy NDJSON records, adding the decoded revision to each.
+ *
+ * Each line is copied unchanged, except that for objects with a valid
+ * revision code as the value of the key, a "decoded" member holding the
+ * selected fields (as in JSON output) is added before the closing brace.
+ * A string value is taken as hexadecimal, a number as decimal. Lines
+ * without (valid) revision code are copied unchanged.
+ *
+ * @param path Name of the NDJSON file, or "-" for standard input
+ * @param key The name of the member holding the revision code
+ * @param spec Fields to add
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_ndjson_file(const char *path, const char *key, const output_spec *spec)
+{
+    line_reader reader;
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    unsigned long line_number = 0;
+    unsigned long not_decoded = 0;
+    size_t length;
+    char *line;
+    while ((line = line_reader_next(&reader, &length)) != NULL) {
+        const char *end = line + length;
+        const char *value;
+        const char *value_end;
+        int is_string;
+        revision_record record = { 0, 0, 1, NULL, NULL };
+
+        ++line_number;
+        // Locate closing brace of the object, allowing trailing white space
+        const char *close = end;
+        while ((close > line) && ((close[-1] == ' ') || (close[-1] == '\t'))) {
+            --close;
+        }
+        const char *open = json_skip_space(line, close);
+        if ((close - open < 2) || (*open != '{') || (close[-1] != '}')
+            || (json_find_member(open, close, key,
+                                 &value, &value_end, &is_string) != EXIT_SUCCESS)
+            || (parse_revision(value, (size_t) (value_end - value),
+                               is_string ? 16 : 10,
+                               &record.raw_code) != EXIT_SUCCESS)
+            || (normalize_revision(record.raw_code, &record.code) != EXIT_SUCCESS)) {
+            if ((length > 0) && (*open == '{')) {
+                ++not_decoded;
+            }
+            out_write(&stdout_buffer, line, length);
+            out_putc(&stdout_buffer, '\n');
+            continue;
+        }
+        const char *last = json_skip_space(open + 1, close - 1);
+        out_write(&stdout_buffer, line, (size_t) (close - 1 - line));
+        out_puts(&stdout_buffer, (last == close - 1) ? "\"decoded\":"
+                                                     : ",\"decoded\":");
+        emit_revision_json(&stdout_buffer, &spec->selection, &record, 1);
+        out_write(&stdout_buffer, close - 1, (size_t) (end - close + 1));
+        out_putc(&stdout_buffer, '\n');
+    }
+    if (not_decoded > 0) {
+        fprintf(stderr, "%s: %lu of %lu records without valid revision code\n",
+                path, not_decoded, line_number);
+    }
+
+    const int exit_status = reader.failed || stdout_buffer.failed
+                ? EXIT_FAILURE : EXIT_SUCCESS;
+    line_reader_close(&reader);
+    return exit_status;
+}
+
+/**
+ * Return the next CSV record, without its line terminator.
+ *
+ * Quoted fields may contain line terminators, so a record can span multiple
+ * lines. The record is not null terminated and remains valid until the next
+ * call.
+ *
+ * @param reader The reader
+ * @param length Receives the length of the record
+ * @param terminator Receives the line terminator ("\n", "\r\n" or "")
+ * @returns The record, or NULL at end of input
+ */
+const char *
+csv_next_record(line_reader *reader,
+                size_t *length,
+                const char **terminator)
+{
+    size_t scanned = 0;         // Relative to start of record
+    int quoted = 0;
+    for (;;) {
+        const char *record = reader->buffer + reader->start;
+        const size_t available = reader->end - reader->start;
+        for (; scanned < available; ++scanned) {
+            const char c = record[scanned];
+            if (c == '"') {
+                quoted = !quoted;
+            }
+            else if ((c == '\n') && !quoted) {
+                break;
+            }
+        }
+        if ((scanned < available) || (reader->eof && (available > 0))) {
+            size_t record_length = scanned;
+            *terminator = "";
+            if (scanned < available) {
+                *terminator = "\n";
+                if ((scanned > 0) && (record[scanned - 1] == '\r')) {
+                    *terminator = "\r\n";
+                    --record_length;
+                }
+                ++scanned;
+            }
+            reader->start += scanned;
+            *length = record_length;
+            return record;
+        }
+        if (reader->eof) {
+            return NULL;
+        }
+        line_reader_fill(reader);
+    }
+}
+
+/**
+ * Locate a field in a CSV record.
+ *
+ * @param record The record
+ * @param length Length of the record
+ * @param column Index of the field, starting at 0
+ * @param field Receives the start of the field, including any quotes
+ * @param field_length Receives the length of the field
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the record has too few fields
+ */
+int
+csv_find_field(const char *record,
+               const size_t length,
+               const int column,
+               const char **field,
+               size_t *field_length)
+{
+    int current = 0;
+    int quoted = 0;
+    size_t start = 0;
+    for (size_t index = 0; index <= length; ++index) {
+        if ((index == length) || ((record[index] == ',') && !quoted)) {
+            if (current == column) {
+                *field = record + start;
+                *field_length = index - start;
+                return EXIT_SUCCESS;
+            }
+            ++current;
+            start = index + 1;
+        }
+        else if (record[index] == '"') {
+            quoted = !quoted;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Count the fields of a CSV record.
+ */
+int
+csv_count_fields(const char *record, const size_t length)
+{
+    int count = 1;
+    int quoted = 0;
+    for (size_t index = 0; index < length; ++index) {
+        if (record[index] == '"') {
+            quoted = !quoted;
+        }
+        else if ((record[index] == ',') && !quoted) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Copy a CSV field's value, removing quotes and surrounding white space.
+ *
+ * @returns The length of the value, truncated to fit the buffer
+ */
+size_t
+csv_field_value(const char *field,
+                size_t length,
+                char *value,
+                const size_t value_size)
+{
+    size_t used = 0;
+    while ((length > 0) && (*field == ' ')) {
+        ++field;
+        --length;
+    }
+    while ((length > 0) && (field[length - 1] == ' ')) {
+        --length;
+    }
+    if ((length >= 2) && (field[0] == '"') && (field[length - 1] == '"')) {
+        ++field;
+        length -= 2;
+    }
+    for (size_t index = 0; (index < length) && (used + 1 < value_size); ++index) {
+        value[used++] = field[index];
+        if ((field[index] == '"') && (index + 1 < length)
+            && (field[index + 1] == '"')) {
+            ++index;            // Escaped quote
+        }
+    }
+    value[used] = '\0';
+    return used;
+}
+
+/**
+ * Copy a CSV table, appending columns with the decoded revision code.
+ *
+ * The first record is the header, to which the ids of the appended fields
+ * are added. The records are tokenized in place and copied unchanged apart
+ * from the appended columns, which are left empty for records without a
+ * valid revision code.
+ *
+ * @param path Name of the CSV file, or "-" for standard input
+ * @param column Name of the column holding the revision code, or its
+ *               number (starting at 1)
+ * @param spec Fields to append
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_csv_file(const char *path, const char *column, const output_spec *spec)
+{
+    line_reader reader;
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    int column_index = -1;
+    if (strspn(column, "0123456789") == strlen(column)) {
+        column_index = atoi(column) - 1;
+    }
+
+    unsigned long record_number = 0;
+    unsigned long not_decoded = 0;
+    int header_fields = 0;
+    const char *terminator;
+    const char *record;
+    size_t length;
+    char value[FIELD_SCRATCH_SIZE];
+    char scratch[FIELD_SCRATCH_SIZE];
+    while ((record = csv_next_record(&reader, &length, &terminator)) != NULL) {
+        const char *field;
+        size_t field_length;
+
+        if (record_number++ == 0) {
+            // Header: locate named column, and add names of new columns
+            for (int index = 0;
+                 (column_index < 0)
+                 && (csv_find_field(record, length, index,
+                                    &field, &field_length) == EXIT_SUCCESS);
+                 ++index) {
+                csv_field_value(field, field_length, value, sizeof(value));
+                if (strcmp(value, column) == 0) {
+                    column_index = index;
+                }
+            }
+            if (column_index < 0) {
+                fprintf(stderr, "%s: no column \"%s\"\n", path, column);
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            header_fields = csv_count_fields(record, length);
+            out_write(&stdout_buffer, record, length);
+            for (int index = 0; index < spec->selection.count; ++index) {
+                out_putc(&stdout_buffer, ',');
+                out_csv_value(&stdout_buffer, spec->selection.fields[index]->id);
+            }
+            out_puts(&stdout_buffer, terminator);
+            continue;
+        }
+
+        out_write(&stdout_buffer, record, length);
+        // Pad short records, so the new columns line up with their names
+        for (int count = csv_count_fields(record, length);
+             count < header_fields;
+             ++count) {
+            out_putc(&stdout_buffer, ',');
+        }
+        revision_record decoded = { 0, 0, 1, NULL, NULL };
+        const int valid = (csv_find_field(record, length, column_index,
+                                          &field, &field_length) == EXIT_SUCCESS)
+                && (parse_revision(value,
+                                   csv_field_value(field, field_length,
+                                                   value, sizeof(value)),
+                                   16, &decoded.raw_code) == EXIT_SUCCESS)
+                && (normalize_revision(decoded.raw_code, &decoded.code)
+                    == EXIT_SUCCESS);
+        if (!valid) {
+            ++not_decoded;
+        }
+        for (int index = 0; index < spec->selection.count; ++index) {
+            const field_descriptor *output_field = spec->selection.fields[index];
+            out_putc(&stdout_buffer, ',');
+            if (valid && field_applies(output_field, &decoded)) {
+                out_csv_value(&stdout_buffer,
+                              field_text(output_field, &decoded,
+                                         scratch, sizeof(scratch)));
+            }
+        }
+        out_puts(&stdout_buffer, terminator);
+    }
+    if (not_decoded > 0) {
+        fprintf(stderr, "%s: %lu of %lu records without valid revision code\n",
+                path, not_decoded, record_number - 1);
+    }
+
+    if (reader.failed || stdout_buffer.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+    return exit_status;
+}
+
+/*
+ * Streaming aggregation of "timestamp code" records into tumbling windows.
+ *
+ * Records are counted per combination of type, processor, memory and
+ * manufacturer, packed into a single key from the field indices. Only the
+ * current window is kept, in a hash table that is emptied when the window
+ * closes, so memory use does not depend on the length of the stream.
+ */
+#define WINDOW_INITIAL_SLOTS 1024
+
+typedef struct {
+    unsigned int key;           // Packed field indices, plus one (0 = free)
+    unsigned long count;
+} window_slot;
+
+typedef struct {
+    long width;                 // Window width in seconds
+    output_format format;
+    long start;                 // Start of current window
+    int active;                 // Whether the current window has records
+    unsigned long records;      // Records in current window
+    unsigned long late;         // Records in current window that were late
+    unsigned long windows;      // Number of windows emitted
+    unsigned long invalid;      // Lines that could not be used
+    size_t slot_count;          // Number of slots, a power of two
+    size_t used;                // Number of slots in use
+    window_slot *slots;
+} window_counts;
+
+/**
+ * Pack the aggregation fields of a (normalized) code into a key.
+ */
+unsigned int
+window_key(const revcode_32 code)
+{
+    return (type_index(code) << 11) | (processor_index(code) << 7)
+           | (physical_memory_index(code) << 4) | manufacturer_index(code);
+}
+
+/**
+ * Rebuild a (new style) code holding the fields of a key.
+ */
+revcode_32
+window_key_code(const unsigned int key)
+{
+    return (((key >> 11) & 0xFF) << 4) | (((key >> 7) & 0xF) << 12)
+           | (((key >> 4) & 0x7) << 20) | ((key & 0xF) << 16) | (1 << 23);
+}
+
+int
+window_counts_init(window_counts *counts,
+                   const long width,
+                   const output_format format)
+{
+    memset(counts, 0, sizeof(*counts));
+    counts->width = width;
+    counts->format = format;
+    counts->slot_count = WINDOW_INITIAL_SLOTS;
+    counts->slots = calloc(counts->slot_count, sizeof(window_slot));
+    if (counts->slots == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void
+window_counts_free(window_counts *counts)
+{
+    free(counts->slots);
+    counts->slots = NULL;
+}
+
+window_slot *
+window_find_slot(window_slot *slots, const size_t slot_count, const unsigned int key)
+{
+    size_t index = (key * 2654435761u) & (slot_count - 1);
+    while ((slots[index].key != 0) && (slots[index].key != key + 1)) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+int
+window_count(window_counts *counts, const unsigned int key)
+{
+    if ((counts->used + 1) * 4 > counts->slot_count * 3) {
+        // Grow; there can be no more than 2^19 different keys
+        const size_t slot_count = counts->slot_count * 2;
+        window_slot *slots = calloc(slot_count, sizeof(window_slot));
+        if (slots == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        for (size_t index = 0; index < counts->slot_count; ++index) {
+            if (counts->slots[index].key != 0) {
+                *window_find_slot(slots, slot_count, counts->slots[index].key - 1)
+                    = counts->slots[index];
+            }
+        }
+        free(counts->slots);
+        counts->slots = slots;
+        counts->slot_count = slot_count;
+    }
+    window_slot *slot = window_find_slot(counts->slots, counts->slot_count, key);
+    if (slot->key == 0) {
+        slot->key = key + 1;
+        counts->used++;
+    }
+    slot->count++;
+    counts->records++;
+    return EXIT_SUCCESS;
+}
+
+int
+compare_window_slots(const void *a, const void *b)
+{
+    const unsigned int key_a = ((const window_slot *) a)->key;
+    const unsigned int key_b = ((const window_slot *) b)->key;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+/**
+ * Output the counts of the current window, and empty it.
+ */
+void
+window_counts_emit(window_counts *counts)
+{
+    static const char *field_ids[] = {
+        "type", "processor", "memory", "manufacturer", "count"
+    };
+    out_buffer *out = &stdout_buffer;
+    char scratch[FIELD_SCRATCH_SIZE];
+    char start[24];
+    char end[24];
+
+    if (!counts->active) {
+        return;
+    }
+    // Move used slots to the front, in key order, for stable output
+    size_t used = 0;
+    for (size_t index = 0; index < counts->slot_count; ++index) {
+        if (counts->slots[index].key != 0) {
+            counts->slots[used++] = counts->slots[index];
+        }
+    }
+    qsort(counts->slots, used, sizeof(window_slot), compare_window_slots);
+
+    snprintf(start, sizeof(start), "%ld", counts->start);
+    snprintf(end, sizeof(end), "%ld", counts->start + counts->width);
+    if ((counts->format == FORMAT_CSV) && (counts->windows == 0)) {
+        out_puts(out, "window_start,window_end");
+        for (size_t field = 0; field < ARRAY_CNT(field_ids); ++field) {
+            out_putc(out, ',');
+            out_puts(out, field_ids[field]);
+        }
+        out_putc(out, '\n');
+    }
+    else if (counts->format == FORMAT_TEXT) {
+        out_puts(out, "Window ");
+        out_puts(out, start);
+        out_puts(out, " - ");
+        out_puts(out, end);
+        out_puts(out, ": ");
+        out_puts(out, decimal_str(counts->records, scratch));
+        out_puts(out, " records");
+        if (counts->late > 0) {
+            out_puts(out, ", ");
+            out_puts(out, decimal_str(counts->late, scratch));
+            out_puts(out, " late");
+        }
+        out_putc(out, '\n');
+    }
+
+    for (size_t index = 0; index < used; ++index) {
+        const revision_record record = {
+            0, window_key_code(counts->slots[index].key - 1),
+            counts->slots[index].count, NULL, NULL
+        };
+        if (counts->format == FORMAT_JSON) {
+            out_puts(out, "{\"window_start\":");
+            out_puts(out, start);
+            out_puts(out, ",\"window_end\":");
+            out_puts(out, end);
+        }
+        else if (counts->format == FORMAT_CSV) {
+            out_puts(out, start);
+            out_putc(out, ',');
+            out_puts(out, end);
+        }
+        else {
+            out_write(out, "   ", 3);
+        }
+        for (size_t field = 0; field < ARRAY_CNT(field_ids); ++field) {
+            const field_descriptor *descriptor
+                        = find_field(field_ids[field], strlen(field_ids[field]));
+            if (counts->format == FORMAT_JSON) {
+                out_puts(out, ",\"");
+                out_puts(out, descriptor->json_key);
+                out_puts(out, "\":");
+                emit_json_value(out, descriptor, &record);
+            }
+            else if (counts->format == FORMAT_CSV) {
+                out_putc(out, ',');
+                out_csv_value(out, field_text(descriptor, &record,
+                                              scratch, sizeof(scratch)));
+            }
+            else {
+                out_puts(out, (field == 0) ? " "
+                              : (field == ARRAY_CNT(field_ids) - 1) ? ": "
+                              : ", ");
+                out_puts(out, field_text(descriptor, &record,
+                                         scratch, sizeof(scratch)));
+            }
+        }
+        out_puts(out, (counts->format == FORMAT_JSON) ? "}\n" : "\n");
+    }
+
+    memset(counts->slots, 0, counts->slot_count * sizeof(window_slot));
+    counts->used = 0;
+    counts->records = 0;
+    counts->late = 0;
+    counts->active = 0;
+    counts->windows++;
+    // Windows are to be seen as they close, not when the buffer is full
+    out_flush(out);
+}
+
+/**
+ * Add the records from a file of "timestamp code" lines to the windows.
+ *
+ * The timestamp is in (possibly fractional) seconds, the code hexadecimal.
+ * A record beyond the current window closes it, a record before the current
+ * window (out of order) is counted in the current window as late.
+ *
+ * @param path Name of the file, or "-" for standard input
+ * @param counts The window state
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_window_file(const char *path, window_counts *counts)
+{
+    line_reader reader;
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    size_t length;
+    char *line;
+    while ((exit_status == EXIT_SUCCESS)
+           && ((line = line_reader_next(&reader, &length)) != NULL)) {
+        char *end;
+        const double timestamp = strtod(line, &end);
+        const char *code = end + strspn(end, " \t,");
+        const size_t code_length = strcspn(code, " \t,");
+        revcode_32 raw_code;
+        revcode_32 normalized;
+        if ((end == line) || (code == end)
+            || (parse_revision(code, code_length, 16, &raw_code) != EXIT_SUCCESS)
+            || (normalize_revision(raw_code, &normalized) != EXIT_SUCCESS)) {
+            if (length > 0) {
+                counts->invalid++;
+            }
+            continue;
+        }
+
+        long start = (long) (timestamp / (double) counts->width) * counts->width;
+        if ((double) start > timestamp) {
+            start -= counts->width;     // Round down for negative timestamps
+        }
+        if (counts->active && (start > counts->start)) {
+            window_counts_emit(counts);
+        }
+        if (!counts->active) {
+            counts->start = start;
+            counts->active = 1;
+        }
+        else if (start < counts->start) {
+            counts->late++;
+        }
+        exit_status = window_count(counts, window_key(normalized));
+    }
+    if (counts->invalid > 0) {
+        fprintf(stderr, "%s: %lu lines without valid timestamp and code\n",
+                path, counts->invalid);
+        counts->invalid = 0;
+    }
+    if (reader.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+    return exit_status;
+}
+
+/*
+ * Persistent fleet inventory index.
+ *
+ * The index file maps host ids to revision codes, using an open addressing
+ * hash table of fixed size slots which is memory mapped, so lookups need no
+ * loading or decoding. Each slot is also a member of one posting list per
+ * indexed attribute (type, processor, memory, manufacturer and revision),
+ * doubly linked through the slots, with the list heads in the file header.
+ * Updates then only touch the slots of hosts that changed.
+ *
+ * The file is in native byte order; the header records it.
+ */
+#define INDEX_MAGIC         "PIRVIDX1"
+#define INDEX_BYTE_ORDER    0x01020304
+#define INDEX_HOST_SIZE     64  // Including terminating null character
+#define INDEX_ATTRIBUTES    5
+#define INDEX_HEAD_COUNT    (256 + 16 + 8 + 16 + 16)
+#define INDEX_INITIAL_SLOTS 1024
+#define INDEX_NONE          0xFFFFFFFF  // No slot (end of list)
+
+#define INDEX_SLOT_FREE     0   // Slot never used
+#define INDEX_SLOT_USED     1   // Slot holds a host
+#define INDEX_SLOT_DELETED  2   // Slot held a host that was removed
+
+const char *index_attribute_ids[INDEX_ATTRIBUTES] = {
+    "type", "processor", "memory", "manufacturer", "revision"
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t slot_count;        // Number of slots, a power of two
+    uint32_t used;              // Number of slots holding a host
+    uint32_t deleted;           // Number of deleted slots
+    uint32_t heads[INDEX_HEAD_COUNT];   // First slot per attribute value
+} index_header;
+
+typedef struct {
+    uint64_t hash;              // Hash of host id
+    uint32_t state;             // INDEX_SLOT_xxx
+    uint32_t code;              // Revision code as supplied
+    uint32_t links[INDEX_ATTRIBUTES][2];    // Previous and next slot
+    char host[INDEX_HOST_SIZE];
+} index_slot;
+
+typedef struct {
+    const char *path;
+    int fd;
+    size_t size;
+    index_header *header;
+    index_slot *slots;
+    const field_descriptor *attributes[INDEX_ATTRIBUTES];
+    unsigned int head_base[INDEX_ATTRIBUTES];   // First head per attribute
+} fleet_index;
+
+uint64_t
+host_hash(const char *host, const size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;      // FNV-1a
+    for (size_t index = 0; index < length; ++index) {
+        hash = (hash ^ (unsigned char) host[index]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Split a "host code" line, separated by white space or a comma.
+ *
+ * @param line The line
+ * @param host Receives the start of the host id
+ * @param host_length Receives the length of the host id, 0 if none
+ * @param code Receives the start of the code
+ * @returns Length of the code, 0 if none
+ */
+size_t
+split_host_line(const char *line,
+                const char **host,
+                size_t *host_length,
+                const char **code)
+{
+    *host = line + strspn(line, " \t");
+    *host_length = strcspn(*host, " \t,");
+    *code = *host + *host_length;
+    *code += strspn(*code, " \t,");
+    return strcspn(*code, " \t,");
+}
+
+/**
+ * Head of the posting list of an attribute for the value in a code.
+ */
+uint32_t *
+index_head(fleet_index *index, const int attribute, const revcode_32 code)
+{
+    const revision_record record = { code, code, 1, NULL, NULL };
+    return &index->header->heads[index->head_base[attribute]
+                                 + field_value(index->attributes[attribute],
+                                               &record)];
+}
+
+void
+index_link(fleet_index *index, const uint32_t slot_index)
+{
+    index_slot *slot = &index->slots[slot_index];
+    const revcode_32 code = map_old_to_new(slot->code);
+    for (int attribute = 0; attribute < INDEX_ATTRIBUTES; ++attribute) {
+        uint32_t *head = index_head(index, attribute, code);
+        slot->links[attribute][0] = INDEX_NONE;
+        slot->links[attribute][1] = *head;
+        if (*head != INDEX_NONE) {
+            index->slots[*head].links[attribute][0] = slot_index;
+        }
+        *head = slot_index;
+    }
+}
+
+void
+index_unlink(fleet_index *index, const uint32_t slot_index)
+{
+    index_slot *slot = &index->slots[slot_index];
+    const revcode_32 code = map_old_to_new(slot->code);
+    for (int attribute = 0; attribute < INDEX_ATTRIBUTES; ++attribute) {
+        const uint32_t previous = slot->links[attribute][0];
+        const uint32_t next = slot->links[attribute][1];
+        if (previous != INDEX_NONE) {
+            index->slots[previous].links[attribute][1] = next;
+        }
+        else {
+            *index_head(index, attribute, code) = next;
+        }
+        if (next != INDEX_NONE) {
+            index->slots[next].links[attribute][0] = previous;
+        }
+    }
+}
+
+/**
+ * Find the slot of a host, or the slot to insert it into.
+ *
+ * @returns Slot index; the slot is INDEX_SLOT_USED only if the host is found
+ */
+uint32_t
+index_find(const fleet_index *index, const char *host, const size_t length)
+{
+    const uint64_t hash = host_hash(host, length);
+    const uint32_t mask = index->header->slot_count - 1;
+    uint32_t insert = INDEX_NONE;
+    for (uint32_t slot_index = (uint32_t) hash & mask; ;
+         slot_index = (slot_index + 1) & mask) {
+        const index_slot *slot = &index->slots[slot_index];
+        if (slot->state == INDEX_SLOT_FREE) {
+            return (insert != INDEX_NONE) ? insert : slot_index;
+        }
+        if ((slot->state == INDEX_SLOT_DELETED) && (insert == INDEX_NONE)) {
+            insert = slot_index;
+        }
+        if ((slot->state == INDEX_SLOT_USED) && (slot->hash == hash)
+            && (strncmp(slot->host, host, length) == 0)
+            && (slot->host[length] == '\0')) {
+            return slot_index;
+        }
+    }
+}
+
+void
+index_close(fleet_index *index)
+{
+    if (index->header != NULL) {
+        msync(index->header, index->size, MS_SYNC);
+        munmap(index->header, index->size);
+        index->header = NULL;
+    }
+    if (index->fd >= 0) {
+        close(index->fd);
+        index->fd = -1;
+    }
+}
+
+/**
+ * Open an index file, creating it (with the given number of slots) if it
+ * does not exist and create is set.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+index_open(fleet_index *index,
+           const char *path,
+           const int create,
+           const uint32_t slot_count)
+{
+    index->path = path;
+    index->header = NULL;
+    unsigned int head_base = 0;
+    for (int attribute = 0; attribute < INDEX_ATTRIBUTES; ++attribute) {
+        index->attributes[attribute]
+                = find_field(index_attribute_ids[attribute],
+                             strlen(index_attribute_ids[attribute]));
+        index->head_base[attribute] = head_base;
+        head_base += index->attributes[attribute]->mask + 1;
+    }
+
+    index->fd = open(path, create ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (index->fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(index->fd, &st) != 0) {
+        fprintf(stderr, "Could not access %s\n", path);
+        index_close(index);
+        return EXIT_FAILURE;
+    }
+    const int initialize = st.st_size == 0;
+    if (initialize) {
+        if (!create) {
+            fprintf(stderr, "%s: empty index\n", path);
+            index_close(index);
+            return EXIT_FAILURE;
+        }
+        index->size = sizeof(index_header) + slot_count * sizeof(index_slot);
+        if (ftruncate(index->fd, (off_t) index->size) != 0) {
+            fprintf(stderr, "Could not size %s\n", path);
+            index_close(index);
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        index->size = (size_t) st.st_size;
+    }
+
+    void *data = mmap(NULL, index->size,
+                      create ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                      MAP_SHARED, index->fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        index_close(index);
+        return EXIT_FAILURE;
+    }
+    index->header = data;
+    index->slots = (index_slot *) (index->header + 1);
+    if (initialize) {
+        memcpy(index->header->magic, INDEX_MAGIC, sizeof(index->header->magic));
+        index->header->byte_order = INDEX_BYTE_ORDER;
+        index->header->slot_count = slot_count;
+        index->header->used = 0;
+        index->header->deleted = 0;
+        memset(index->header->heads, 0xFF, sizeof(index->header->heads));
+    }
+    else if ((index->size < sizeof(index_header))
+             || (memcmp(index->header->magic, INDEX_MAGIC,
+                        sizeof(index->header->magic)) != 0)
+             || (index->header->byte_order != INDEX_BYTE_ORDER)
+             || (index->size != sizeof(index_header)
+                                + index->header->slot_count * sizeof(index_slot))) {
+        fprintf(stderr, "%s: not a valid index file\n", path);
+        index_close(index);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Rebuild an index with twice the number of slots.
+ *
+ * The hosts are inserted into a new file, which then replaces the index.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+index_grow(fleet_index *index)
+{
+    char path[PATH_MAX];
+    fleet_index grown;
+    snprintf(path, sizeof(path), "%s.tmp", index->path);
+    unlink(path);
+    if (index_open(&grown, path, 1,
+                   index->header->slot_count * 2) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    for (uint32_t slot_index = 0;
+         slot_index < index->header->slot_count; ++slot_index) {
+        const index_slot *slot = &index->slots[slot_index];
+        if (slot->state != INDEX_SLOT_USED) {
+            continue;
+        }
+        const uint32_t target = index_find(&grown, slot->host, strlen(slot->host));
+        grown.slots[target] = *slot;
+        index_link(&grown, target);
+        grown.header->used++;
+    }
+    index_close(&grown);
+    if (rename(path, index->path) != 0) {
+        fprintf(stderr, "Could not replace %s\n", index->path);
+        return EXIT_FAILURE;
+    }
+    const char *index_path = index->path;
+    index_close(index);
+    return index_open(index, index_path, 1, 0);
+}
+
+/**
+ * Apply a delta stream of "host code" lines to an index, creating it if
+ * needed. Only hosts that are new or have a different code are written; a
+ * code of "-" removes the host.
+ *
+ * @param index_path Name of the index file
+ * @param path Name of the delta file, or "-" for standard input
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+index_upsert(const char *index_path, const char *path)
+{
+    fleet_index index;
+    line_reader reader;
+    if (index_open(&index, index_path, 1, INDEX_INITIAL_SLOTS) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        index_close(&index);
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    unsigned long added = 0;
+    unsigned long changed = 0;
+    unsigned long removed = 0;
+    unsigned long unchanged = 0;
+    unsigned long invalid = 0;
+    size_t length;
+    char *line;
+    while ((exit_status == EXIT_SUCCESS)
+           && ((line = line_reader_next(&reader, &length)) != NULL)) {
+        const char *host;
+        size_t host_length;
+        const char *code;
+        const size_t code_length = split_host_line(line, &host, &host_length,
+                                                   &code);
+        revcode_32 raw_code = 0;
+        revcode_32 normalized;
+        const int remove = (code_length == 1) && (code[0] == '-');
+        if ((host_length == 0) || (host_length >= INDEX_HOST_SIZE)
+            || (!remove
+                && ((parse_revision(code, code_length, 16, &raw_code) != EXIT_SUCCESS)
+                    || (normalize_revision(raw_code, &normalized) != EXIT_SUCCESS)))) {
+            if (host_length > 0) {
+                invalid++;
+            }
+            continue;
+        }
+
+        uint32_t slot_index = index_find(&index, host, host_length);
+        index_slot *slot = &index.slots[slot_index];
+        if (slot->state == INDEX_SLOT_USED) {
+            if (remove) {
+                index_unlink(&index, slot_index);
+                slot->state = INDEX_SLOT_DELETED;
+                index.header->used--;
+                index.header->deleted++;
+                removed++;
+            }
+            else if (slot->code == raw_code) {
+                unchanged++;
+            }
+            else {
+                index_unlink(&index, slot_index);
+                slot->code = raw_code;
+                index_link(&index, slot_index);
+                changed++;
+            }
+            continue;
+        }
+        if (remove) {
+            unchanged++;
+            continue;
+        }
+
+        // Keep the table at most 3/4 full, counting deleted slots
+        if ((index.header->used + index.header->deleted + 1) * 4
+            > index.header->slot_count * 3) {
+            exit_status = index_grow(&index);
+            if (exit_status != EXIT_SUCCESS) {
+                break;
+            }
+            slot_index = index_find(&index, host, host_length);
+            slot = &index.slots[slot_index];
+        }
+        if (slot->state == INDEX_SLOT_DELETED) {
+            index.header->deleted--;
+        }
+        slot->hash = host_hash(host, host_length);
+        slot->state = INDEX_SLOT_USED;
+        slot->code = raw_code;
+        memset(slot->host, 0, sizeof(slot->host));
+        memcpy(slot->host, host, host_length);
+        index_link(&index, slot_index);
+        index.header->used++;
+        added++;
+    }
+    fprintf(stderr, "%s: %lu added, %lu changed, %lu removed, %lu unchanged",
+            index_path, added, changed, removed, unchanged);
+    if (invalid > 0) {
+        fprintf(stderr, ", %lu invalid", invalid);
+    }
+    fprintf(stderr, "\n");
+    if (reader.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+    index_close(&index);
+    return exit_status;
+}
+
+int
+index_emit(fleet_index *index, const uint32_t slot_index, revision_output *output)
+{
+    const index_slot *slot = &index->slots[slot_index];
+    const revision_record record = {
+        slot->code, map_old_to_new(slot->code), 1, slot->host, NULL
+    };
+    return emit_record(output, &record);
+}
+
+/**
+ * Output the records of the given hosts.
+ *
+ * @param index_path Name of the index file
+ * @param hosts Host ids
+ * @param host_count Number of host ids
+ * @param output Destination of the records
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if a host is not in the index
+ */
+int
+index_lookup(const char *index_path,
+             const char **hosts,
+             const int host_count,
+             revision_output *output)
+{
+    fleet_index index;
+    if (index_open(&index, index_path, 0, 0) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    int exit_status = EXIT_SUCCESS;
+    for (int host = 0; (host < host_count) && !output->out->failed; ++host) {
+        const uint32_t slot_index = index_find(&index, hosts[host],
+                                               strlen(hosts[host]));
+        if (index.slots[slot_index].state != INDEX_SLOT_USED) {
+            fprintf(stderr, "%s: no host \"%s\"\n", index_path, hosts[host]);
+            exit_status = EXIT_FAILURE;
+            continue;
+        }
+        index_emit(&index, slot_index, output);
+    }
+    index_close(&index);
+    return output->out->failed ? EXIT_FAILURE : exit_status;
+}
+
+/**
+ * Output the records of all hosts matching all constraints.
+ *
+ * If any constraint is on an indexed attribute, the posting lists of the
+ * values it accepts are walked (those of the constraint with the fewest
+ * hosts), otherwise all slots are scanned. Either way, matching only
+ * involves comparing field values, not decoding.
+ *
+ * @param index_path Name of the index file
+ * @param query Constraints, e.g. "type=4B,memory=4GB"
+ * @param output Destination of the records
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+index_query(const char *index_path, const char *query, revision_output *output)
+{
+    field_constraint constraints[MAX_CONSTRAINTS];
+    int constraint_count;
+    fleet_index index;
+    if ((parse_constraints(query, constraints, &constraint_count) != EXIT_SUCCESS)
+        || (index_open(&index, index_path, 0, 0) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+
+    // Pick the constraint on an indexed attribute whose posting lists are
+    // shortest in total
+    int list_attribute = -1;
+    const field_constraint *list_constraint = NULL;
+    unsigned long list_length = ULONG_MAX;
+    for (int constraint = 0; constraint < constraint_count; ++constraint) {
+        for (int attribute = 0; attribute < INDEX_ATTRIBUTES; ++attribute) {
+            if (constraints[constraint].field != index.attributes[attribute]) {
+                continue;
+            }
+            unsigned long length = 0;
+            for (unsigned int value = 0;
+                 (value <= index.attributes[attribute]->mask) && (length < list_length);
+                 ++value) {
+                if (!constraint_accepts(&constraints[constraint], value)) {
+                    continue;
+                }
+                const uint32_t head = index.head_base[attribute] + value;
+                for (uint32_t slot = index.header->heads[head];
+                     (slot != INDEX_NONE) && (length < list_length);
+                     slot = index.slots[slot].links[attribute][1]) {
+                    ++length;
+                }
+            }
+            if (length < list_length) {
+                list_attribute = attribute;
+                list_constraint = &constraints[constraint];
+                list_length = length;
+            }
+        }
+    }
+
+    // Walk the posting list of each value accepted in turn, or all slots
+    unsigned long matches = 0;
+    const unsigned int value_count = (list_attribute >= 0)
+                                     ? index.attributes[list_attribute]->mask + 1 : 1;
+    for (unsigned int value = 0; value < value_count; ++value) {
+        uint32_t slot_index = 0;
+        if (list_attribute >= 0) {
+            if (!constraint_accepts(list_constraint, value)) {
+                continue;
+            }
+            slot_index = index.header->heads[index.head_base[list_attribute] + value];
+        }
+        while ((slot_index != INDEX_NONE)
+               && (slot_index < index.header->slot_count) && !output->out->failed) {
+            const index_slot *slot = &index.slots[slot_index];
+            if (slot->state == INDEX_SLOT_USED) {
+                const revision_record record = {
+                    slot->code, map_old_to_new(slot->code), 1, slot->host, NULL
+                };
+                if (constraints_match(constraints, constraint_count, &record)) {
+                    emit_record(output, &record);
+                    matches++;
+                }
+            }
+            slot_index = (list_attribute >= 0) ? slot->links[list_attribute][1]
+                                               : slot_index + 1;
+        }
+    }
+    fprintf(stderr, "%lu of %lu hosts match\n",
+            matches, (unsigned long) index.header->used);
+    index_close(&index);
+    return output->out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Compressed bitmaps of row numbers, in the style of Roaring bitmaps. Rows
+ * are grouped by their upper 16 bits into containers, each holding the
+ * lower 16 bits of its rows either as a sorted array, while there are at
+ * most BITMAP_ARRAY_MAX of them, or as a bitset of all 65536 possible rows.
+ * This keeps both sparse and dense bitmaps small, and lets AND and OR work
+ * a container at a time.
+ */
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS     (65536 / 64)
+
+typedef struct {
+    uint32_t key;               // Upper 16 bits of the rows
+    uint32_t cardinality;       // Number of rows
+    uint32_t capacity;          // Allocated array size, if an array
+    uint16_t *array;            // Sorted lower 16 bits, or NULL if a bitset
+    uint64_t *bits;             // Bitset of lower 16 bits, or NULL if an array
+} bitmap_container;
+
+typedef struct {
+    uint32_t count;             // Number of containers, ordered by key
+    uint32_t capacity;
+    bitmap_container *containers;
+} row_bitmap;
+
+void
+bitmap_init(row_bitmap *bitmap)
+{
+    bitmap->count = 0;
+    bitmap->capacity = 0;
+    bitmap->containers = NULL;
+}
+
+void
+bitmap_free(row_bitmap *bitmap)
+{
+    for (uint32_t index = 0; index < bitmap->count; ++index) {
+        free(bitmap->containers[index].array);
+        free(bitmap->containers[index].bits);
+    }
+    free(bitmap->containers);
+    bitmap_init(bitmap);
+}
+
+unsigned long
+bitmap_cardinality(const row_bitmap *bitmap)
+{
+    unsigned long cardinality = 0;
+    for (uint32_t index = 0; index < bitmap->count; ++index) {
+        cardinality += bitmap->containers[index].cardinality;
+    }
+    return cardinality;
+}
+
+/**
+ * Add an empty container (an array) at the end of a bitmap.
+ *
+ * @returns The container, or NULL if out of memory
+ */
+bitmap_container *
+bitmap_add_container(row_bitmap *bitmap, const uint32_t key)
+{
+    if (bitmap->count == bitmap->capacity) {
+        const uint32_t capacity = (bitmap->capacity > 0)
+                                  ? bitmap->capacity * 2 : 4;
+        bitmap_container *containers = realloc(bitmap->containers,
+                                               capacity * sizeof(*containers));
+        if (containers == NULL) {
+            return NULL;
+        }
+        bitmap->containers = containers;
+        bitmap->capacity = capacity;
+    }
+    bitmap_container *container = &bitmap->containers[bitmap->count++];
+    container->key = key;
+    container->cardinality = 0;
+    container->capacity = 0;
+    container->array = NULL;
+    container->bits = NULL;
+    return container;
+}
+
+/**
+ * Turn a container holding a bitset into an array, if it is sparse enough.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+container_compact(bitmap_container *container)
+{
+    uint32_t cardinality = 0;
+    for (int word = 0; word < BITMAP_WORDS; ++word) {
+        cardinality += (uint32_t) __builtin_popcountll(container->bits[word]);
+    }
+    container->cardinality = cardinality;
+    if (cardinality > BITMAP_ARRAY_MAX) {
+        return EXIT_SUCCESS;
+    }
+    container->array = malloc((cardinality > 0 ? cardinality : 1)
+                              * sizeof(*container->array));
+    if (container->array == NULL) {
+        return EXIT_FAILURE;
+    }
+    container->capacity = cardinality;
+    uint32_t used = 0;
+    for (int word = 0; word < BITMAP_WORDS; ++word) {
+        for (uint64_t bits = container->bits[word]; bits != 0; bits &= bits - 1) {
+            container->array[used++] = (uint16_t) (word * 64
+                                                   + __builtin_ctzll(bits));
+        }
+    }
+    free(container->bits);
+    container->bits = NULL;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Set the rows of a container in a bitset.
+ */
+void
+container_set_bits(const bitmap_container *container, uint64_t *bits)
+{
+    if (container->bits != NULL) {
+        for (int word = 0; word < BITMAP_WORDS; ++word) {
+            bits[word] |= container->bits[word];
+        }
+    }
+    else {
+        for (uint32_t index = 0; index < container->cardinality; ++index) {
+            bits[container->array[index] >> 6]
+                    |= (uint64_t) 1 << (container->array[index] & 63);
+        }
+    }
+}
+
+int
+container_contains(const bitmap_container *container, const uint16_t low)
+{
+    if (container->bits != NULL) {
+        return (container->bits[low >> 6] >> (low & 63)) & 1;
+    }
+    uint32_t first = 0;
+    uint32_t last = container->cardinality;
+    while (first < last) {
+        const uint32_t middle = (first + last) / 2;
+        if (container->array[middle] < low) {
+            first = middle + 1;
+        }
+        else {
+            last = middle;
+        }
+    }
+    return (first < container->cardinality) && (container->array[first] == low);
+}
+
+/**
+ * Add a row to a bitmap. Rows must be added in increasing order.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+bitmap_append(row_bitmap *bitmap, const uint32_t row)
+{
+    bitmap_container *container = (bitmap->count > 0)
+                                  ? &bitmap->containers[bitmap->count - 1]
+                                  : NULL;
+    if ((container == NULL) || (container->key != row >> 16)) {
+        container = bitmap_add_container(bitmap, row >> 16);
+        if (container == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+    const uint16_t low = (uint16_t) row;
+    if (container->bits != NULL) {
+        container->bits[low >> 6] |= (uint64_t) 1 << (low & 63);
+        container->cardinality++;
+        return EXIT_SUCCESS;
+    }
+    if (container->cardinality == BITMAP_ARRAY_MAX) {
+        uint64_t *bits = calloc(BITMAP_WORDS, sizeof(*bits));
+        if (bits == NULL) {
+            return EXIT_FAILURE;
+        }
+        container_set_bits(container, bits);
+        container->bits = bits;
+        free(container->array);
+        container->array = NULL;
+        container->bits[low >> 6] |= (uint64_t) 1 << (low & 63);
+        container->cardinality++;
+        return EXIT_SUCCESS;
+    }
+    if (container->cardinality == container->capacity) {
+        const uint32_t capacity = (container->capacity > 0)
+                                  ? container->capacity * 2 : 16;
+        uint16_t *array = realloc(container->array, capacity * sizeof(*array));
+        if (array == NULL) {
+            return EXIT_FAILURE;
+        }
+        container->array = array;
+        container->capacity = capacity;
+    }
+    container->array[container->cardinality++] = low;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Combine two containers with the same key.
+ *
+ * @param first First container
+ * @param second Second container
+ * @param intersect If set, AND the containers, otherwise OR them
+ * @param result Receives the result, unless empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+container_combine(const bitmap_container *first,
+                  const bitmap_container *second,
+                  const int intersect,
+                  row_bitmap *result)
+{
+    bitmap_container combined = { first->key, 0, 0, NULL, NULL };
+
+    if (intersect && ((first->bits == NULL) || (second->bits == NULL))) {
+        // The result is at most as large as the array
+        const bitmap_container *array = (first->bits == NULL) ? first : second;
+        const bitmap_container *other = (array == first) ? second : first;
+        combined.array = malloc(array->cardinality * sizeof(*combined.array));
+        if (combined.array == NULL) {
+            return EXIT_FAILURE;
+        }
+        for (uint32_t index = 0; index < array->cardinality; ++index) {
+            if (container_contains(other, array->array[index])) {
+                combined.array[combined.cardinality++] = array->array[index];
+            }
+        }
+        combined.capacity = array->cardinality;
+    }
+    else if (!intersect && (first->bits == NULL) && (second->bits == NULL)
+             && (first->cardinality + second->cardinality <= BITMAP_ARRAY_MAX)) {
+        // Merge two small arrays
+        combined.capacity = first->cardinality + second->cardinality;
+        combined.array = malloc(combined.capacity * sizeof(*combined.array));
+        if (combined.array == NULL) {
+            return EXIT_FAILURE;
+        }
+        uint32_t index1 = 0;
+        uint32_t index2 = 0;
+        while ((index1 < first->cardinality) || (index2 < second->cardinality)) {
+            uint16_t low;
+            if ((index2 >= second->cardinality)
+                || ((index1 < first->cardinality)
+                    && (first->array[index1] < second->array[index2]))) {
+                low = first->array[index1++];
+            }
+            else {
+                low = second->array[index2++];
+                if ((index1 < first->cardinality) && (first->array[index1] == low)) {
+                    ++index1;
+                }
+            }
+            combined.array[combined.cardinality++] = low;
+        }
+    }
+    else {
+        combined.bits = calloc(BITMAP_WORDS, sizeof(*combined.bits));
+        if (combined.bits == NULL) {
+            return EXIT_FAILURE;
+        }
+        container_set_bits(first, combined.bits);
+        if (intersect) {
+            for (int word = 0; word < BITMAP_WORDS; ++word) {
+                combined.bits[word] &= second->bits[word];
+            }
+        }
+        else {
+            container_set_bits(second, combined.bits);
+        }
+        if (container_compact(&combined) != EXIT_SUCCESS) {
+            free(combined.bits);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (combined.cardinality == 0) {
+        free(combined.array);
+        free(combined.bits);
+        return EXIT_SUCCESS;
+    }
+    bitmap_container *container = bitmap_add_container(result, combined.key);
+    if (container == NULL) {
+        free(combined.array);
+        free(combined.bits);
+        return EXIT_FAILURE;
+    }
+    *container = combined;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Copy a container, for the OR of bitmaps.
+ */
+int
+container_copy(const bitmap_container *container, row_bitmap *result)
+{
+    const bitmap_container empty = { container->key, 0, 0, NULL, NULL };
+    return container_combine(container, &empty, 0, result);
+}
+
+/**
+ * Combine two bitmaps.
+ *
+ * @param first First bitmap
+ * @param second Second bitmap
+ * @param intersect If set, AND the bitmaps, otherwise OR them
+ * @param result Receives the result, must be initialized and empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+bitmap_combine(const row_bitmap *first,
+               const row_bitmap *second,
+               const int intersect,
+               row_bitmap *result)
+{
+    uint32_t index1 = 0;
+    uint32_t index2 = 0;
+    int exit_status = EXIT_SUCCESS;
+    while ((exit_status == EXIT_SUCCESS)
+           && (index1 < first->count) && (index2 < second->count)) {
+        const bitmap_container *container1 = &first->containers[index1];
+        const bitmap_container *container2 = &second->containers[index2];
+        if (container1->key == container2->key) {
+            exit_status = container_combine(container1, container2,
+                                            intersect, result);
+            ++index1;
+            ++index2;
+        }
+        else if (container1->key < container2->key) {
+            exit_status = intersect ? EXIT_SUCCESS
+                                    : container_copy(container1, result);
+            ++index1;
+        }
+        else {
+            exit_status = intersect ? EXIT_SUCCESS
+                                    : container_copy(container2, result);
+            ++index2;
+        }
+    }
+    while (!intersect && (exit_status == EXIT_SUCCESS) && (index1 < first->count)) {
+        exit_status = container_copy(&first->containers[index1++], result);
+    }
+    while (!intersect && (exit_status == EXIT_SUCCESS) && (index2 < second->count)) {
+        exit_status = container_copy(&second->containers[index2++], result);
+    }
+    return exit_status;
+}
+
+/*
+ * Bitmap indexes of a list of codes: one bitmap of rows per value of each
+ * field taken from the code, i.e. the flags, type, revision, processor,
+ * memory and manufacturer. Rows are numbered from 0 in input order, one
+ * per line, so lines without a valid code are in no bitmap.
+ *
+ * Indexes are built once and saved to a bitmap index file, which queries
+ * map, so a query only combines bitmaps and decodes nothing. The file
+ * consists of a bitmap_file_header, a bitmap_file_bitmap per bitmap, and
+ * per bitmap its bitmap_file_container entries followed by the contents of
+ * the containers (a bitset if holding more than BITMAP_ARRAY_MAX rows,
+ * otherwise a sorted array), each 8 byte aligned, in native byte order.
+ */
+#define MAX_BITMAP_FIELDS   16
+#define BITMAP_MAGIC        "PIRVBMP"
+#define BITMAP_VERSION      1
+#define BITMAP_BYTE_ORDER   0x01020304
+#define BITMAP_FIELD_SIZE   16
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;                      // Size of the file
+    uint32_t rows;
+    uint32_t invalid;                   // Rows without a valid code
+    uint32_t field_count;
+    uint32_t bitmap_count;
+    char fields[MAX_BITMAP_FIELDS][BITMAP_FIELD_SIZE]; // Ids of the fields
+} bitmap_file_header;
+
+typedef struct {
+    uint64_t offset;                    // Offset of the container entries
+    uint32_t count;                     // Number of containers
+    uint32_t reserved;
+} bitmap_file_bitmap;
+
+typedef struct {
+    uint32_t key;
+    uint32_t cardinality;
+    uint64_t offset;                    // Offset of the array or bitset
+} bitmap_file_container;
+
+typedef struct {
+    int field_count;
+    const field_descriptor *fields[MAX_BITMAP_FIELDS];
+    unsigned int base[MAX_BITMAP_FIELDS];       // First bitmap per field
+    unsigned int bitmap_count;
+    row_bitmap *bitmaps;
+    uint32_t rows;
+    unsigned long invalid;
+    void *map;                  // Mapped index file holding the containers'
+    size_t map_size;            // rows, or NULL if built in memory
+} bitmap_index;
+
+int
+bitmap_index_init(bitmap_index *index)
+{
+    unsigned int bitmap_count = 0;
+    index->field_count = 0;
+    for (size_t field = 0; field < ARRAY_CNT(field_table); ++field) {
+        const field_descriptor *descriptor = &field_table[field];
+        // Fields of the code, omitting aliases and combinations of others
+        if ((descriptor->mask == 0) || (descriptor->flags & FIELD_RAW_CODE)
+            || (descriptor->flags & FIELD_NOT_DEFAULT)) {
+            continue;
+        }
+        index->fields[index->field_count] = descriptor;
+        index->base[index->field_count++] = bitmap_count;
+        bitmap_count += descriptor->mask + 1;
+    }
+    index->bitmap_count = bitmap_count;
+    index->bitmaps = malloc(bitmap_count * sizeof(*index->bitmaps));
+    if (index->bitmaps == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int bitmap = 0; bitmap < bitmap_count; ++bitmap) {
+        bitmap_init(&index->bitmaps[bitmap]);
+    }
+    index->rows = 0;
+    index->invalid = 0;
+    index->map = NULL;
+    index->map_size = 0;
+    return EXIT_SUCCESS;
+}
+
+void
+bitmap_index_free(bitmap_index *index)
+{
+    for (unsigned int bitmap = 0; bitmap < index->bitmap_count; ++bitmap) {
+        if (index->map != NULL) {
+            // The containers' rows are in the mapped file
+            free(index->bitmaps[bitmap].containers);
+        }
+        else {
+            bitmap_free(&index->bitmaps[bitmap]);
+        }
+    }
+    free(index->bitmaps);
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    }
+}
+
+/**
+ * Size of the rows of a container in a bitmap index file, including
+ * padding.
+ */
+size_t
+bitmap_file_rows_size(const uint32_t cardinality)
+{
+    return (cardinality > BITMAP_ARRAY_MAX)
+           ? BITMAP_WORDS * sizeof(uint64_t)
+           : (cardinality * sizeof(uint16_t) + 7) & ~(size_t) 7;
+}
+
+/**
+ * Write bitmap indexes to a bitmap index file. The file is written under a
+ * temporary name and then renamed, so a query never sees it partially
+ * written.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+bitmap_index_write(const bitmap_index *index, const char *path)
+{
+    bitmap_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BITMAP_MAGIC, sizeof(BITMAP_MAGIC));
+    header.version = BITMAP_VERSION;
+    header.byte_order = BITMAP_BYTE_ORDER;
+    header.rows = index->rows;
+    header.invalid = (uint32_t) index->invalid;
+    header.field_count = (uint32_t) index->field_count;
+    header.bitmap_count = index->bitmap_count;
+    for (int field = 0; field < index->field_count; ++field) {
+        strncpy(header.fields[field], index->fields[field]->id, BITMAP_FIELD_SIZE - 1);
+    }
+
+    // Lay out the bitmaps, then per bitmap its containers and their rows
+    size_t size = sizeof(header) + index->bitmap_count * sizeof(bitmap_file_bitmap);
+    for (unsigned int bitmap = 0; bitmap < index->bitmap_count; ++bitmap) {
+        const row_bitmap *rows = &index->bitmaps[bitmap];
+        size += rows->count * sizeof(bitmap_file_container);
+        for (uint32_t container = 0; container < rows->count; ++container) {
+            size += bitmap_file_rows_size(rows->containers[container].cardinality);
+        }
+    }
+    header.size = size;
+
+    char *data = calloc(1, size);
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(data, &header, sizeof(header));
+    bitmap_file_bitmap *bitmaps = (bitmap_file_bitmap *) (data + sizeof(header));
+    size_t offset = sizeof(header) + index->bitmap_count * sizeof(bitmap_file_bitmap);
+    for (unsigned int bitmap = 0; bitmap < index->bitmap_count; ++bitmap) {
+        const row_bitmap *rows = &index->bitmaps[bitmap];
+        bitmap_file_container *containers = (bitmap_file_container *) (data + offset);
+        bitmaps[bitmap].offset = offset;
+        bitmaps[bitmap].count = rows->count;
+        offset += rows->count * sizeof(bitmap_file_container);
+        for (uint32_t container = 0; container < rows->count; ++container) {
+            const bitmap_container *source = &rows->containers[container];
+            containers[container].key = source->key;
+            containers[container].cardinality = source->cardinality;
+            containers[container].offset = offset;
+            if (source->cardinality > BITMAP_ARRAY_MAX) {
+                memset(data + offset, 0, BITMAP_WORDS * sizeof(uint64_t));
+                container_set_bits(source, (uint64_t *) (data + offset));
+            }
+            else if (source->bits != NULL) {
+                // Bitsets only shrink below BITMAP_ARRAY_MAX rows in results
+                uint16_t *array = (uint16_t *) (data + offset);
+                uint32_t used = 0;
+                for (int word = 0; word < BITMAP_WORDS; ++word) {
+                    for (uint64_t bits = source->bits[word];
+                         bits != 0;
+                         bits &= bits - 1) {
+                        array[used++] = (uint16_t) (word * 64 + __builtin_ctzll(bits));
+                    }
+                }
+            }
+            else {
+                memcpy(data + offset, source->array,
+                       source->cardinality * sizeof(uint16_t));
+            }
+            offset += bitmap_file_rows_size(source->cardinality);
+        }
+    }
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int exit_status = EXIT_SUCCESS;
+    const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (write_all(fd, data, size) != EXIT_SUCCESS)
+        || (close(fd) != 0) || (rename(temp_path, path) != 0)) {
+        fprintf(stderr, "Could not write %s\n", path);
+        exit_status = EXIT_FAILURE;
+    }
+    free(data);
+    return exit_status;
+}
+
+/**
+ * Map a bitmap index file. The bitmaps' containers refer to their rows in
+ * the mapped file, so nothing is decoded or copied but the container
+ * entries.
+ *
+ * @param index Receives the bitmap indexes, to be released with
+ *              bitmap_index_free()
+ * @param path Name of the file
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+bitmap_index_load(bitmap_index *index, const char *path)
+{
+    if (bitmap_index_init(index) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        bitmap_index_free(index);
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t) sizeof(bitmap_file_header))) {
+        data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: not a valid bitmap index file\n", path);
+        bitmap_index_free(index);
+        return EXIT_FAILURE;
+    }
+    index->map = data;
+    index->map_size = (size_t) st.st_size;
+
+    const size_t size = (size_t) st.st_size;
+    const bitmap_file_header *header = data;
+    int valid = (memcmp(header->magic, BITMAP_MAGIC, sizeof(BITMAP_MAGIC)) == 0)
+                && (header->byte_order == BITMAP_BYTE_ORDER)
+                && (header->size == size);
+    if (valid && (header->version != BITMAP_VERSION)) {
+        fprintf(stderr, "%s: unsupported bitmap index file version %u\n",
+                path, (unsigned int) header->version);
+        bitmap_index_free(index);
+        return EXIT_FAILURE;
+    }
+    // The fields (and so the bitmaps) must be those indexed by this version
+    valid = valid && (header->field_count == (uint32_t) index->field_count)
+            && (header->bitmap_count == index->bitmap_count)
+            && (sizeof(*header)
+                + index->bitmap_count * sizeof(bitmap_file_bitmap) <= size);
+    for (int field = 0; valid && (field < index->field_count); ++field) {
+        valid = strncmp(header->fields[field], index->fields[field]->id,
+                        BITMAP_FIELD_SIZE) == 0;
+    }
+    const bitmap_file_bitmap *bitmaps
+        = (const bitmap_file_bitmap *) ((const char *) data + sizeof(*header));
+    for (unsigned int bitmap = 0; valid && (bitmap < index->bitmap_count); ++bitmap) {
+        const uint64_t offset = bitmaps[bitmap].offset;
+        const uint32_t count = bitmaps[bitmap].count;
+        valid = (offset % 8 == 0) && (offset <= size)
+                && (count <= (size - offset) / sizeof(bitmap_file_container));
+        const bitmap_file_container *containers
+            = (const bitmap_file_container *) ((const char *) data + offset);
+        row_bitmap *rows = &index->bitmaps[bitmap];
+        for (uint32_t container = 0; valid && (container < count); ++container) {
+            const bitmap_file_container *entry = &containers[container];
+            valid = (entry->key <= 0xFFFF) && (entry->cardinality > 0)
+                    && (entry->cardinality <= 65536)
+                    && ((container == 0) || (entry->key > containers[container - 1].key))
+                    && (entry->offset % 8 == 0) && (entry->offset <= size)
+                    && (bitmap_file_rows_size(entry->cardinality)
+                        <= size - entry->offset);
+            bitmap_container *target = valid ? bitmap_add_container(rows, entry->key)
+                                             : NULL;
+            if (target == NULL) {
+                valid = 0;
+                break;
+            }
+            char *rows_data = (char *) data + entry->offset;
+            target->cardinality = entry->cardinality;
+            if (entry->cardinality > BITMAP_ARRAY_MAX) {
+                target->bits = (uint64_t *) rows_data;
+            }
+            else {
+                target->array = (uint16_t *) rows_data;
+                target->capacity = entry->cardinality;
+            }
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: not a valid bitmap index file\n", path);
+        bitmap_index_free(index);
+        return EXIT_FAILURE;
+    }
+    index->rows = header->rows;
+    index->invalid = header->invalid;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The bitmap of rows where a field has a value, or NULL if the field is
+ * not indexed.
+ */
+const row_bitmap *
+bitmap_index_find(const bitmap_index *index,
+                  const field_descriptor *field,
+                  const unsigned int value)
+{
+    for (int indexed = 0; indexed < index->field_count; ++indexed) {
+        if (index->fields[indexed] == field) {
+            return &index->bitmaps[index->base[indexed] + value];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add the codes in a file (one per line) to bitmap indexes.
+ *
+ * @param index The bitmap indexes
+ * @param path Name of the file, or "-" for standard input
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+bitmap_index_file(bitmap_index *index, const char *path)
+{
+    line_reader reader;
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    size_t length;
+    char *line;
+    while ((exit_status == EXIT_SUCCESS)
+           && ((line = line_reader_next(&reader, &length)) != NULL)) {
+        const uint32_t row = index->rows++;
+        const char *code = line + strspn(line, " \t");
+        revcode_32 raw_code;
+        revcode_32 normalized;
+        if ((parse_revision(code, strcspn(code, " \t,"), 16, &raw_code) != EXIT_SUCCESS)
+            || (normalize_revision(raw_code, &normalized) != EXIT_SUCCESS)) {
+            index->invalid++;
+            continue;
+        }
+        const revision_record record = { raw_code, normalized, 1, NULL, NULL };
+        for (int field = 0;
+             (field < index->field_count) && (exit_status == EXIT_SUCCESS); ++field) {
+            const unsigned int value = field_value(index->fields[field], &record);
+            exit_status = bitmap_append(&index->bitmaps[index->base[field] + value],
+                                        row);
+        }
+        if (exit_status != EXIT_SUCCESS) {
+            fprintf(stderr, "Out of memory\n");
+        }
+    }
+    if (reader.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+    return exit_status;
+}
+
+/**
+ * Find the rows matching a constraint, the OR of the bitmaps of all values
+ * it accepts.
+ *
+ * @param index The bitmap indexes
+ * @param constraint The constraint
+ * @param result Receives the matching rows, must be initialized and empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+bitmap_constraint(const bitmap_index *index,
+                  const field_constraint *constraint,
+                  row_bitmap *result)
+{
+    if (bitmap_index_find(index, constraint->field, 0) == NULL) {
+        fprintf(stderr, "Field %s is not indexed\n", constraint->field->id);
+        return EXIT_FAILURE;
+    }
+    for (unsigned int value = 0; value <= constraint->field->mask; ++value) {
+        if (!constraint_accepts(constraint, value)) {
+            continue;
+        }
+        row_bitmap combined;
+        bitmap_init(&combined);
+        const int exit_status = bitmap_combine(result,
+                                               bitmap_index_find(index,
+                                                                 constraint->field,
+                                                                 value),
+                                               0, &combined);
+        bitmap_free(result);
+        *result = combined;
+        if (exit_status != EXIT_SUCCESS) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Evaluate a query on bitmap indexes.
+ *
+ * A query consists of constraints such as "memory>=2GB", combined with '&'
+ * (or ',') and '|', where '&' binds tighter than '|'.
+ *
+ * @param index The bitmap indexes
+ * @param query The query
+ * @param result Receives the matching rows, must be initialized and empty
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+bitmap_query(const bitmap_index *index, const char *query, row_bitmap *result)
+{
+    char conjunction[1024];
+    const char *start = query;
+    for (;;) {
+        const char *end = strchr(start, '|');
+        const size_t length = (end != NULL) ? (size_t) (end - start)
+                                            : strlen(start);
+        if (length >= sizeof(conjunction)) {
+            fprintf(stderr, "Query too long\n");
+            return EXIT_FAILURE;
+        }
+        memcpy(conjunction, start, length);
+        conjunction[length] = '\0';
+        for (char *and = strchr(conjunction, '&'); and != NULL;
+             and = strchr(and, '&')) {
+            *and = ',';
+        }
+
+        field_constraint constraints[MAX_CONSTRAINTS];
+        int constraint_count;
+        if (parse_constraints(conjunction, constraints,
+                              &constraint_count) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        // AND the bitmaps of the constraints, then OR that into the result
+        row_bitmap rows;
+        bitmap_init(&rows);
+        int exit_status = EXIT_SUCCESS;
+        for (int constraint = 0;
+             (constraint < constraint_count) && (exit_status == EXIT_SUCCESS);
+             ++constraint) {
+            row_bitmap matching;
+            bitmap_init(&matching);
+            exit_status = bitmap_constraint(index, &constraints[constraint],
+                                            &matching);
+            if ((exit_status == EXIT_SUCCESS) && (constraint > 0)) {
+                row_bitmap combined;
+                bitmap_init(&combined);
+                exit_status = bitmap_combine(&rows, &matching, 1, &combined);
+                bitmap_free(&matching);
+                matching = combined;
+            }
+            bitmap_free(&rows);
+            rows = matching;
+        }
+        if (exit_status == EXIT_SUCCESS) {
+            row_bitmap combined;
+            bitmap_init(&combined);
+            exit_status = bitmap_combine(result, &rows, 0, &combined);
+            bitmap_free(result);
+            *result = combined;
+        }
+        bitmap_free(&rows);
+        if (exit_status != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (end == NULL) {
+            break;
+        }
+        start = end + 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+void
+bitmap_output_row(const uint32_t row, out_buffer *out)
+{
+    char row_text[FIELD_SCRATCH_SIZE];
+    out_puts(out, decimal_str(row, row_text));
+    out_putc(out, '\n');
+}
+
+/**
+ * Output the rows of a container, one per line.
+ */
+void
+bitmap_output_rows(const bitmap_container *container, out_buffer *out)
+{
+    if (container->bits == NULL) {
+        for (uint32_t index = 0; index < container->cardinality; ++index) {
+            bitmap_output_row((container->key << 16) | container->array[index], out);
+        }
+        return;
+    }
+    for (int word = 0; word < BITMAP_WORDS; ++word) {
+        for (uint64_t bits = container->bits[word]; bits != 0; bits &= bits - 1) {
+            bitmap_output_row((container->key << 16)
+                              | (uint32_t) (word * 64 + __builtin_ctzll(bits)),
+                              out);
+        }
+    }
+}
+
+/**
+ * Build bitmap indexes of the codes in files.
+ *
+ * @param index Receives the bitmap indexes, to be released with
+ *              bitmap_index_free()
+ * @param paths Names of the files, standard input if none
+ * @param path_count Number of files
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+bitmap_index_files(bitmap_index *index, const char **paths, const int path_count)
+{
+    if (bitmap_index_init(index) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    int exit_status = (path_count == 0) ? bitmap_index_file(index, "-")
+                                        : EXIT_SUCCESS;
+    for (int path = 0; (path < path_count) && (exit_status == EXIT_SUCCESS); ++path) {
+        exit_status = bitmap_index_file(index, paths[path]);
+    }
+    if (exit_status != EXIT_SUCCESS) {
+        bitmap_index_free(index);
+    }
+    return exit_status;
+}
+
+/**
+ * Build bitmap indexes of the codes in files, and save them to a bitmap
+ * index file for queries.
+ *
+ * @param index_path Name of the bitmap index file
+ * @param paths Names of the files, standard input if none
+ * @param path_count Number of files
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+build_bitmap_index(const char *index_path, const char **paths, const int path_count)
+{
+    bitmap_index index;
+    if (bitmap_index_files(&index, paths, path_count) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    const int exit_status = bitmap_index_write(&index, index_path);
+    if (exit_status == EXIT_SUCCESS) {
+        fprintf(stderr, "%s: %lu rows", index_path, (unsigned long) index.rows);
+        if (index.invalid > 0) {
+            fprintf(stderr, " (%lu without a valid code)", index.invalid);
+        }
+        fprintf(stderr, "\n");
+    }
+    bitmap_index_free(&index);
+    return exit_status;
+}
+
+/**
+ * Output the rows matching a query, one per line, followed by the number of
+ * them on standard error.
+ *
+ * With a bitmap index file, its bitmaps are mapped and combined, without
+ * decoding anything. Otherwise bitmap indexes of the codes in the files are
+ * built first, decoding each line once.
+ *
+ * @param query The query, as for bitmap_query()
+ * @param index_path Name of the bitmap index file, or NULL
+ * @param paths Names of the files, standard input if none, if no index file
+ * @param path_count Number of files
+ * @param out Destination of the rows
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_bitmap_query(const char *query,
+                     const char *index_path,
+                     const char **paths,
+                     const int path_count,
+                     out_buffer *out)
+{
+    bitmap_index index;
+    if (((index_path != NULL) ? bitmap_index_load(&index, index_path)
+                              : bitmap_index_files(&index, paths, path_count))
+        != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    row_bitmap rows;
+    bitmap_init(&rows);
+    const int exit_status = bitmap_query(&index, query, &rows);
+    if (exit_status == EXIT_SUCCESS) {
+        for (uint32_t container = 0; container < rows.count; ++container) {
+            bitmap_output_rows(&rows.containers[container], out);
+        }
+        fprintf(stderr, "%lu of %lu rows match",
+                bitmap_cardinality(&rows), (unsigned long) index.rows);
+        if (index.invalid > 0) {
+            fprintf(stderr, " (%lu rows without a valid code)", index.invalid);
+        }
+        fprintf(stderr, "\n");
+    }
+    bitmap_free(&rows);
+    bitmap_index_free(&index);
+    return (exit_status == EXIT_SUCCESS) && !out->failed
+           ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Differences between two fleet snapshots of "host code" lines. The smaller
+ * snapshot (by file size) is loaded into a hash table of hosts, then the
+ * other one is streamed past it, so each is read once and only the smaller
+ * one is held in memory. Hosts left unmatched in the table are reported
+ * last.
+ */
+#define DIFF_INITIAL_SIZE 1024
+
+typedef struct {
+    uint64_t hash;
+    char *host;                 // Host id, NULL if the entry is unused
+    revcode_32 code;
+    int matched;                // Set once seen in the streamed snapshot
+} diff_entry;
+
+typedef struct {
+    size_t size;                // Number of entries, a power of two
+    size_t used;
+    diff_entry *entries;
+} diff_table;
+
+typedef struct {
+    const output_spec *spec;
+    out_buffer *out;
+    unsigned long added;
+    unsigned long removed;
+    unsigned long changed;
+    unsigned long unchanged;
+    unsigned long invalid;
+} diff_state;
+
+diff_entry *
+diff_table_find(const diff_table *table,
+                const char *host,
+                const size_t host_length,
+                const uint64_t hash)
+{
+    const size_t mask = table->size - 1;
+    for (size_t index = (size_t) hash & mask; ; index = (index + 1) & mask) {
+        diff_entry *entry = &table->entries[index];
+        if ((entry->host == NULL)
+            || ((entry->hash == hash) && (strncmp(entry->host, host, host_length) == 0)
+                && (entry->host[host_length] == '\0'))) {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Add a host to the table, replacing its code if already present.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+diff_table_add(diff_table *table,
+               const char *host,
+               const size_t host_length,
+               const revcode_32 code)
+{
+    if ((table->used + 1) * 4 > table->size * 3) {
+        diff_entry *entries = calloc(table->size * 2, sizeof(*entries));
+        if (entries == NULL) {
+            return EXIT_FAILURE;
+        }
+        diff_table grown = { table->size * 2, table->used, entries };
+        for (size_t index = 0; index < table->size; ++index) {
+            const diff_entry *entry = &table->entries[index];
+            if (entry->host != NULL) {
+                *diff_table_find(&grown, entry->host, strlen(entry->host),
+                                 entry->hash) = *entry;
+            }
+        }
+        free(table->entries);
+        *table = grown;
+    }
+    const uint64_t hash = host_hash(host, host_length);
+    diff_entry *entry = diff_table_find(table, host, host_length, hash);
+    if (entry->host == NULL) {
+        entry->host = malloc(host_length + 1);
+        if (entry->host == NULL) {
+            return EXIT_FAILURE;
+        }
+        memcpy(entry->host, host, host_length);
+        entry->host[host_length] = '\0';
+        entry->hash = hash;
+        table->used++;
+    }
+    entry->code = code;
+    return EXIT_SUCCESS;
+}
+
+void
+diff_table_free(diff_table *table)
+{
+    for (size_t index = 0; index < table->size; ++index) {
+        free(table->entries[index].host);
+    }
+    free(table->entries);
+}
+
+/**
+ * Whether a field shows up in the changes between codes.
+ */
+int
+diff_field(const field_descriptor *field)
+{
+    return (field->mask != 0) && !(field->flags & FIELD_RAW_CODE);
+}
+
+/**
+ * Output the difference for one host.
+ *
+ * @param diff The diff state
+ * @param host Host id
+ * @param host_length Length of the host id
+ * @param old_record Record in the old snapshot, or NULL if not present
+ * @param new_record Record in the new snapshot, or NULL if not present
+ */
+void
+diff_emit(diff_state *diff,
+          const char *host,
+          const size_t host_length,
+          const revision_record *old_record,
+          const revision_record *new_record)
+{
+    out_buffer *out = diff->out;
+    const field_selection *selection = &diff->spec->selection;
+    const int json = diff->spec->format == FORMAT_JSON;
+    char scratch[FIELD_SCRATCH_SIZE];
+    char old_scratch[FIELD_SCRATCH_SIZE];
+
+    if ((old_record != NULL) && (new_record != NULL)
+        && (old_record->raw_code == new_record->raw_code)) {
+        diff->unchanged++;
+        return;
+    }
+    const char *change = (old_record == NULL) ? "added"
+                         : (new_record == NULL) ? "removed" : "changed";
+    if (old_record == NULL) {
+        diff->added++;
+    }
+    else if (new_record == NULL) {
+        diff->removed++;
+    }
+    else {
+        diff->changed++;
+    }
+
+    if (json) {
+        out_puts(out, "{\"host\":");
+        out_json_string(out, host, host_length);
+        out_puts(out, ",\"change\":\"");
+        out_puts(out, change);
+        out_putc(out, '"');
+        if (old_record != NULL) {
+            out_puts(out, ",\"old\":");
+            emit_revision_json(out, selection, old_record, 1);
+        }
+        if (new_record != NULL) {
+            out_puts(out, ",\"new\":");
+            emit_revision_json(out, selection, new_record, 1);
+        }
+    }
+    else {
+        out_puts(out, (old_record == NULL) ? "+ " : (new_record == NULL) ? "- " : "~ ");
+        out_write(out, host, host_length);
+        out_putc(out, ' ');
+        if (old_record != NULL) {
+            out_puts(out, hex_str(old_record->raw_code, scratch));
+        }
+        if ((old_record != NULL) && (new_record != NULL)) {
+            out_puts(out, " -> ");
+        }
+        if (new_record != NULL) {
+            out_puts(out, hex_str(new_record->raw_code, scratch));
+        }
+    }
+
+    if ((old_record != NULL) && (new_record != NULL)) {
+        // List the fields that differ, as "memory 1GB -> 4GB" or in JSON
+        int differences = 0;
+        for (int index = 0; index < selection->count; ++index) {
+            const field_descriptor *field = selection->fields[index];
+            if (!diff_field(field)) {
+                continue;
+            }
+            const char *old_text = field_applies(field, old_record)
+                                   ? field_text(field, old_record,
+                                                old_scratch, sizeof(old_scratch))
+                                   : "-";
+            const char *new_text = field_applies(field, new_record)
+                                   ? field_text(field, new_record,
+                                                scratch, sizeof(scratch))
+                                   : "-";
+            if (strcmp(old_text, new_text) == 0) {
+                continue;
+            }
+            if (differences++ == 0) {
+                out_puts(out, json ? ",\"fields\":[\"" : ": ");
+            }
+            else {
+                out_puts(out, json ? "\",\"" : ", ");
+            }
+            out_puts(out, field->id);
+            if (!json) {
+                out_putc(out, ' ');
+                out_puts(out, old_text);
+                out_puts(out, " -> ");
+                out_puts(out, new_text);
+            }
+        }
+        if (json) {
+            out_puts(out, (differences > 0) ? "\"]" : ",\"fields\":[]");
+        }
+    }
+    out_puts(out, json ? "}\n" : "\n");
+}
+
+/**
+ * Read a "host code" line of a snapshot.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the line has no valid code
+ */
+int
+diff_parse_line(const char *line,
+                const char **host,
+                size_t *host_length,
+                revision_record *record)
+{
+    const char *code;
+    const size_t code_length = split_host_line(line, host, host_length, &code);
+    if ((*host_length == 0)
+        || (parse_revision(code, code_length, 16, &record->raw_code) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    record->count = 1;
+    record->name = NULL;
+    record->cpuinfo = NULL;
+    return normalize_revision(record->raw_code, &record->code);
+}
+
+off_t
+snapshot_size(const char *path)
+{
+    struct stat st;
+    if ((strcmp(path, "-") == 0) || (stat(path, &st) != 0) || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+/**
+ * Output the differences between two fleet snapshots.
+ *
+ * @param old_path Name of the old snapshot, or "-" for standard input
+ * @param new_path Name of the new snapshot, or "-" for standard input
+ * @param spec Output format and fields to compare
+ * @param out Destination of the differences
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_diff(const char *old_path,
+             const char *new_path,
+             const output_spec *spec,
+             out_buffer *out)
+{
+    diff_state diff = { spec, out, 0, 0, 0, 0, 0 };
+    diff_table table = { DIFF_INITIAL_SIZE, 0, NULL };
+    line_reader reader;
+    size_t length;
+    char *line;
+    const char *host;
+    size_t host_length;
+    revision_record record;
+
+    // Load the smaller one of the snapshots, a pipe counting as large
+    const off_t old_size = snapshot_size(old_path);
+    const off_t new_size = snapshot_size(new_path);
+    const int load_old = (old_size >= 0) && ((new_size < 0) || (old_size <= new_size));
+    const char *load_path = load_old ? old_path : new_path;
+    const char *stream_path = load_old ? new_path : old_path;
+
+    table.entries = calloc(table.size, sizeof(*table.entries));
+    if (table.entries == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (line_reader_open(&reader, load_path) != EXIT_SUCCESS) {
+        diff_table_free(&table);
+        return EXIT_FAILURE;
+    }
+    int exit_status = EXIT_SUCCESS;
+    while ((exit_status == EXIT_SUCCESS)
+           && ((line = line_reader_next(&reader, &length)) != NULL)) {
+        if (diff_parse_line(line, &host, &host_length, &record) != EXIT_SUCCESS) {
+            diff.invalid += (host_length > 0);
+            continue;
+        }
+        exit_status = diff_table_add(&table, host, host_length, record.raw_code);
+        if (exit_status != EXIT_SUCCESS) {
+            fprintf(stderr, "Out of memory\n");
+        }
+    }
+    if (reader.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+
+    if ((exit_status == EXIT_SUCCESS)
+        && (line_reader_open(&reader, stream_path) == EXIT_SUCCESS)) {
+        while (((line = line_reader_next(&reader, &length)) != NULL) && !out->failed) {
+            if (diff_parse_line(line, &host, &host_length, &record) != EXIT_SUCCESS) {
+                diff.invalid += (host_length > 0);
+                continue;
+            }
+            diff_entry *entry = diff_table_find(&table, host, host_length,
+                                                host_hash(host, host_length));
+            if (entry->host == NULL) {
+                diff_emit(&diff, host, host_length,
+                          load_old ? NULL : &record, load_old ? &record : NULL);
+                continue;
+            }
+            const revision_record loaded = {
+                entry->code, map_old_to_new(entry->code), 1, NULL, NULL
+            };
+            entry->matched = 1;
+            diff_emit(&diff, host, host_length,
+                      load_old ? &loaded : &record, load_old ? &record : &loaded);
+        }
+        if (reader.failed) {
+            exit_status = EXIT_FAILURE;
+        }
+        line_reader_close(&reader);
+    }
+    else {
+        exit_status = EXIT_FAILURE;
+    }
+
+    // Hosts only in the loaded snapshot
+    for (size_t index = 0;
+         (exit_status == EXIT_SUCCESS) && (index < table.size); ++index) {
+        const diff_entry *entry = &table.entries[index];
+        if ((entry->host == NULL) || entry->matched) {
+            continue;
+        }
+        const revision_record loaded = {
+            entry->code, map_old_to_new(entry->code), 1, NULL, NULL
+        };
+        diff_emit(&diff, entry->host, strlen(entry->host),
+                  load_old ? &loaded : NULL, load_old ? NULL : &loaded);
+    }
+    diff_table_free(&table);
+
+    fprintf(stderr, "%lu added, %lu removed, %lu changed, %lu unchanged",
+            diff.added, diff.removed, diff.changed, diff.unchanged);
+    if (diff.invalid > 0) {
+        fprintf(stderr, ", %lu lines without a valid code", diff.invalid);
+    }
+    fprintf(stderr, "\n");
+    return (exit_status == EXIT_SUCCESS) && !out->failed
+           ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Reverse lookup: all valid codes matching constraints. Rather than trying
+ * every code, the candidate values of each field of new style codes are
+ * enumerated from the lookup tables, pruned by the constraints on the
+ * field, and only their combinations are tried. Old style codes are tried
+ * by their new style equivalents.
+ */
+#define MAX_MATCH_FIELDS 16
+
+/**
+ * Whether a field value is defined for new style codes, i.e. has an entry
+ * in its lookup table. Index 15 of the manufacturer and revision is only
+ * used by this program for old style codes.
+ */
+int
+new_style_value_valid(const field_descriptor *field, const unsigned int value)
+{
+    char scratch[FIELD_SCRATCH_SIZE];
+    const revcode_32 code = (1 << 23) | (value << field->shift);
+    const revision_record record = { code, code, 1, NULL, NULL };
+
+    if (field->render == render_memory) {
+        return physical_memory_mbytes(code) != 0;
+    }
+    if ((field->render == render_manufacturer) || (field->render == render_revision)) {
+        return (value != 0xF) && (strcmp(field_text(field, &record, scratch,
+                                                    sizeof(scratch)), "???") != 0);
+    }
+    return strcmp(field_text(field, &record, scratch, sizeof(scratch)), "???") != 0;
+}
+
+/**
+ * Output all valid codes matching constraints, in ascending order.
+ *
+ * Flags (overvoltage, OTP and warranty) are only set in the codes if
+ * constraints require it.
+ *
+ * @param text The constraints, e.g. "type=4B,memory>=2GB"
+ * @param output Destination of the codes
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+process_match(const char *text, revision_output *output)
+{
+    field_constraint constraints[MAX_CONSTRAINTS];
+    int constraint_count;
+    if (parse_constraints(text, constraints, &constraint_count) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    unsigned long matches = 0;
+    for (revcode_32 code = 0;
+         code < reader_tables()->counts[TABLE_OLD_REVISION]; ++code) {
+        revision_record record = { code, 0, 1, NULL, NULL };
+        if ((normalize_revision(code, &record.code) == EXIT_SUCCESS)
+            && constraints_match(constraints, constraint_count, &record)) {
+            emit_record(output, &record);
+            matches++;
+        }
+    }
+
+    // Candidate values per field, the highest field first so the codes
+    // come out in ascending order
+    const field_descriptor *fields[MAX_MATCH_FIELDS];
+    unsigned char candidates[MAX_MATCH_FIELDS][256];
+    unsigned int candidate_count[MAX_MATCH_FIELDS];
+    unsigned int position[MAX_MATCH_FIELDS];
+    int field_count = 0;
+    for (size_t index = 0; index < ARRAY_CNT(field_table); ++index) {
+        const field_descriptor *field = &field_table[index];
+        if ((field->mask == 0) || (field->flags & FIELD_RAW_CODE)
+            || (field->flags & FIELD_NOT_DEFAULT)) {
+            continue;
+        }
+        int constrained = 0;
+        for (int constraint = 0; constraint < constraint_count; ++constraint) {
+            constrained |= constraints[constraint].field == field;
+        }
+        int slot = field_count++;
+        while ((slot > 0) && (fields[slot - 1]->shift < field->shift)) {
+            fields[slot] = fields[slot - 1];
+            memcpy(candidates[slot], candidates[slot - 1], sizeof(candidates[slot]));
+            candidate_count[slot] = candidate_count[slot - 1];
+            --slot;
+        }
+        fields[slot] = field;
+        candidate_count[slot] = 0;
+        for (unsigned int value = 0; value <= field->mask; ++value) {
+            int accepted = (field->shift == 23) ? (value == 1)
+                           : (field->render == NULL) ? (constrained || (value == 0))
+                           : new_style_value_valid(field, value);
+            for (int constraint = 0;
+                 accepted && (constraint < constraint_count); ++constraint) {
+                if (constraints[constraint].field == field) {
+                    accepted = constraint_accepts(&constraints[constraint], value);
+                }
+            }
+            if (accepted) {
+                candidates[slot][candidate_count[slot]++] = (unsigned char) value;
+            }
+        }
+        if (candidate_count[slot] == 0) {
+            field_count = 0;    // No new style code can match
+            break;
+        }
+    }
+
+    memset(position, 0, sizeof(position));
+    while ((field_count > 0) && !output->out->failed) {
+        revcode_32 code = 0;
+        for (int field = 0; field < field_count; ++field) {
+            code |= (revcode_32) candidates[field][position[field]]
+                    << fields[field]->shift;
+        }
+        const revision_record record = { code, code, 1, NULL, NULL };
+        // Constraints on fields not enumerated, such as memory_mb
+        if (constraints_match(constraints, constraint_count, &record)) {
+            emit_record(output, &record);
+            matches++;
+        }
+        int field = field_count - 1;
+        while ((field >= 0) && (++position[field] == candidate_count[field])) {
+            position[field--] = 0;
+        }
+        if (field < 0) {
+            break;
+        }
+    }
+    fprintf(stderr, "%lu codes match\n", matches);
+    return output->out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Compiled table files.
+ *
+ * A table specification is text, with lines "table index value", e.g.
+ * "type 0x17 5" or "memory 6 16384", applied on top of the tables in use
+ * (normally the built-in ones), so it only needs to list additions and
+ * changes. Empty lines and lines starting with '#' are ignored. The tables
+ * are type, processor, manufacturer and revision (names), memory (size in
+ * MB), and old (the new style equivalent of an old style code).
+ *
+ * A compiled table file consists of a tables_header, the entries of each
+ * table (32-bit numbers, or offsets of null terminated strings in the
+ * file), and the strings, in native byte order. Lookups index the mapped
+ * file directly, so loading only involves checking it.
+ */
+#define TABLES_MAGIC        "PIRVTBL"
+#define TABLES_VERSION      1
+#define TABLES_BYTE_ORDER   0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size;                      // Size of the file
+    uint32_t counts[TABLE_COUNT];       // Entries per table
+    uint32_t offsets[TABLE_COUNT];      // Offset of the entries per table
+} tables_header;
+
+/*
+ * Tables being compiled, with all entries held as allocated strings or
+ * numbers.
+ */
+typedef struct {
+    uint32_t counts[TABLE_COUNT];
+    char **strings[TABLE_COUNT];
+    uint32_t *values[TABLE_COUNT];
+} table_builder;
+
+void
+table_builder_free(table_builder *builder)
+{
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        if (builder->strings[table] != NULL) {
+            for (uint32_t index = 0; index < table_infos[table].max_count; ++index) {
+                free(builder->strings[table][index]);
+            }
+        }
+        free(builder->strings[table]);
+        free(builder->values[table]);
+    }
+}
+
+/**
+ * Set an entry of a table being compiled, extending the table if needed.
+ * Any entries skipped when extending are left undefined ("???", or 0 for
+ * memory and not valid for old style codes).
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+table_builder_set(table_builder *builder,
+                  const table_id table,
+                  const uint32_t index,
+                  const char *text,
+                  const size_t text_length,
+                  const uint32_t value)
+{
+    while (builder->counts[table] <= index) {
+        const uint32_t added = builder->counts[table]++;
+        if (table_infos[table].strings) {
+            builder->strings[table][added] = strdup("???");
+            if (builder->strings[table][added] == NULL) {
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            builder->values[table][added] = (table == TABLE_OLD_REVISION)
+                                            ? OLD_REV_NOT_VALID : 0;
+        }
+    }
+    if (table_infos[table].strings) {
+        char *copy = malloc(text_length + 1);
+        if (copy == NULL) {
+            return EXIT_FAILURE;
+        }
+        memcpy(copy, text, text_length);
+        copy[text_length] = '\0';
+        free(builder->strings[table][index]);
+        builder->strings[table][index] = copy;
+    }
+    else {
+        builder->values[table][index] = value;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Start compiling tables from the tables in use.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE (out of memory)
+ */
+int
+table_builder_init(table_builder *builder)
+{
+    memset(builder, 0, sizeof(*builder));
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        const uint32_t max_count = table_infos[table].max_count;
+        if (table_infos[table].strings) {
+            builder->strings[table] = calloc(max_count, sizeof(char *));
+        }
+        else {
+            builder->values[table] = calloc(max_count, sizeof(uint32_t));
+        }
+        if ((builder->strings[table] == NULL) && (builder->values[table] == NULL)) {
+            table_builder_free(builder);
+            return EXIT_FAILURE;
+        }
+        for (uint32_t index = 0; index < reader_tables()->counts[table]; ++index) {
+            const char *text = table_infos[table].strings
+                               ? table_str((table_id) table, index, 0, NULL) : "";
+            if (table_builder_set(builder, (table_id) table, index,
+                                  text, strlen(text),
+                                  table_infos[table].strings
+                                  ? 0 : table_value((table_id) table, index, 0))
+                != EXIT_SUCCESS) {
+                table_builder_free(builder);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Apply a table specification to tables being compiled.
+ *
+ * @param builder The tables
+ * @param path Name of the specification, or "-" for standard input
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+table_builder_read(table_builder *builder, const char *path)
+{
+    line_reader reader;
+    if (line_reader_open(&reader, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    unsigned long line_number = 0;
+    size_t length;
+    char *line;
+    while ((exit_status == EXIT_SUCCESS)
+           && ((line = line_reader_next(&reader, &length)) != NULL)) {
+        ++line_number;
+        while ((length > 0) && ((line[length - 1] == ' ')
+                                || (line[length - 1] == '\t'))) {
+            line[--length] = '\0';
+        }
+        line += strspn(line, " \t");
+        if ((*line == '\0') || (*line == '#')) {
+            continue;
+        }
+
+        const size_t name_length = strcspn(line, " \t");
+        int table = 0;
+        while ((table < TABLE_COUNT)
+               && ((strncmp(table_infos[table].name, line, name_length) != 0)
+                   || (table_infos[table].name[name_length] != '\0'))) {
+            ++table;
+        }
+        char *end;
+        const char *index_text = line + name_length + strspn(line + name_length, " \t");
+        const unsigned long index = strtoul(index_text, &end, 0);
+        const char *value = end + strspn(end, " \t");
+        char *value_end;
+        const unsigned long number = strtoul(value, &value_end, 0);
+        if ((table == TABLE_COUNT) || (end == index_text)
+            || ((*end != ' ') && (*end != '\t'))
+            || (index >= table_infos[table].max_count) || (*value == '\0')
+            || (!table_infos[table].strings
+                && ((*value_end != '\0') || (number > 0xFFFFFFFFUL)))
+            || (table_infos[table].strings && (strlen(value) >= FIELD_SCRATCH_SIZE))) {
+            fprintf(stderr, "%s:%lu: invalid table entry\n", path, line_number);
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        exit_status = table_builder_set(builder, (table_id) table, (uint32_t) index,
+                                        value, strlen(value), (uint32_t) number);
+        if (exit_status != EXIT_SUCCESS) {
+            fprintf(stderr, "Out of memory\n");
+        }
+    }
+    if (reader.failed) {
+        exit_status = EXIT_FAILURE;
+    }
+    line_reader_close(&reader);
+    return exit_status;
+}
+
+/**
+ * Write compiled tables to a file. The file is written under a temporary
+ * name and then renamed, so a process loading it never sees it partially
+ * written.
+ *
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+table_builder_write(const table_builder *builder, const char *path)
+{
+    tables_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TABLES_MAGIC, sizeof(TABLES_MAGIC));
+    header.version = TABLES_VERSION;
+    header.byte_order = TABLES_BYTE_ORDER;
+
+    // Lay out the entries, then the strings
+    size_t size = sizeof(header);
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        header.counts[table] = builder->counts[table];
+        header.offsets[table] = (uint32_t) size;
+        size += builder->counts[table] * sizeof(uint32_t);
+    }
+    const size_t strings_offset = size;
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        for (uint32_t index = 0;
+             table_infos[table].strings && (index < builder->counts[table]); ++index) {
+            size += strlen(builder->strings[table][index]) + 1;
+        }
+    }
+    header.size = (uint32_t) size;
+
+    char *data = calloc(1, size);
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(data, &header, sizeof(header));
+    size_t string_offset = strings_offset;
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        uint32_t *entries = (uint32_t *) (data + header.offsets[table]);
+        for (uint32_t index = 0; index < builder->counts[table]; ++index) {
+            if (!table_infos[table].strings) {
+                entries[index] = builder->values[table][index];
+                continue;
+            }
+            const size_t length = strlen(builder->strings[table][index]) + 1;
+            memcpy(data + string_offset, builder->strings[table][index], length);
+            entries[index] = (uint32_t) string_offset;
+            string_offset += length;
+        }
+    }
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int exit_status = EXIT_SUCCESS;
+    const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (write_all(fd, data, size) != EXIT_SUCCESS)
+        || (close(fd) != 0) || (rename(temp_path, path) != 0)) {
+        fprintf(stderr, "Could not write %s\n", path);
+        exit_status = EXIT_FAILURE;
+    }
+    free(data);
+    return exit_status;
+}
+
+/**
+ * Compile a table specification on top of the tables in use.
+ *
+ * @param spec_path Name of the specification, or "-" for standard input
+ * @param path Name of the compiled table file to write
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+compile_tables(const char *spec_path, const char *path)
+{
+    table_builder builder;
+    if (table_builder_init(&builder) != EXIT_SUCCESS) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    int exit_status = table_builder_read(&builder, spec_path);
+    if (exit_status == EXIT_SUCCESS) {
+        exit_status = table_builder_write(&builder, path);
+    }
+    table_builder_free(&builder);
+    return exit_status;
+}
+
+/**
+ * Map a compiled table file.
+ *
+ * @param path Name of the file
+ * @returns The tables (to be released with unload_tables()), or NULL if the
+ *          file could not be loaded
+ */
+lookup_tables *
+load_tables(const char *path)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t) sizeof(tables_header))
+        && (st.st_size <= 0xFFFFFFFF)) {
+        data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: not a valid table file\n", path);
+        return NULL;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    const tables_header *header = data;
+    int valid = (memcmp(header->magic, TABLES_MAGIC, sizeof(TABLES_MAGIC)) == 0)
+                && (header->byte_order == TABLES_BYTE_ORDER)
+                && (header->size == size);
+    if (valid && (header->version != TABLES_VERSION)) {
+        fprintf(stderr, "%s: unsupported table file version %u\n",
+                path, (unsigned int) header->version);
+        munmap(data, size);
+        return NULL;
+    }
+    // Check all entries are within the file, and strings are terminated
+    for (int table = 0; valid && (table < TABLE_COUNT); ++table) {
+        const uint32_t offset = header->offsets[table];
+        const uint32_t count = header->counts[table];
+        valid = (count <= table_infos[table].max_count) && (offset % 4 == 0)
+                && (offset >= sizeof(tables_header))
+                && (offset + (size_t) count * sizeof(uint32_t) <= size);
+        const uint32_t *entries = (const uint32_t *) ((const char *) data + offset);
+        for (uint32_t index = 0;
+             valid && table_infos[table].strings && (index < count); ++index) {
+            valid = (entries[index] < size)
+                    && (memchr((const char *) data + entries[index], '\0',
+                               size - entries[index]) != NULL);
+        }
+    }
+    lookup_tables *tables = valid ? malloc(sizeof(*tables)) : NULL;
+    if (tables == NULL) {
+        fprintf(stderr, "%s: not a valid table file\n", path);
+        munmap(data, size);
+        return NULL;
+    }
+    tables->base = data;
+    tables->size = size;
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        tables->counts[table] = header->counts[table];
+        tables->entries[table] = (const char *) data + header->offsets[table];
+    }
+    return tables;
+}
+
+void
+unload_tables(lookup_tables *tables)
+{
+    munmap((void *) tables->base, tables->size);
+    free(tables);
+}
+
+/*
+ * Tables replaced by a reload, queued until no reader can be using them.
+ * Releasing them is left to a thread of its own, so waiting for readers
+ * never delays handling the next SIGHUP.
+ */
+typedef struct retired_tables {
+    struct retired_tables *next;
+    lookup_tables *tables;
+    unsigned long epoch;                // Epoch of the replacement
+} retired_tables;
+
+retired_tables *retired_list;
+pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t retired_added = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Whether no reader can be using tables replaced at an epoch, i.e. every
+ * online reader came online since.
+ */
+int
+tables_quiescent(const unsigned long epoch)
+{
+    if (atomic_load(&untracked_readers) > 0) {
+        return 0;
+    }
+    for (int reader = 0; reader < MAX_TABLE_READERS; ++reader) {
+        const unsigned long reader_epoch = atomic_load(&reader_epochs[reader]);
+        if ((reader_epoch != 0) && (reader_epoch < epoch)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Thread releasing replaced tables once no reader can be using them.
+ */
+void *
+tables_reclaimer_main(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&retired_lock);
+    for (;;) {
+        while (retired_list == NULL) {
+            pthread_cond_wait(&retired_added, &retired_lock);
+        }
+        for (retired_tables **link = &retired_list; *link != NULL;) {
+            retired_tables *retired = *link;
+            if (!tables_quiescent(retired->epoch)) {
+                link = &retired->next;
+                continue;
+            }
+            *link = retired->next;
+            unload_tables(retired->tables);
+            free(retired);
+        }
+        if (retired_list != NULL) {
+            // Check again shortly, or as soon as more tables are retired
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 10000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&retired_added, &retired_lock, &deadline);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Thread replacing the tables in use with the ones from a compiled table
+ * file each time SIGHUP is received. New tables take effect immediately;
+ * the previous ones are queued for tables_reclaimer_main() to release.
+ *
+ * @param arg Name of the compiled table file
+ */
+void *
+tables_reloader_main(void *arg)
+{
+    const char *path = arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
+    for (;;) {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) != 0) {
+            continue;
+        }
+        lookup_tables *tables = load_tables(path);
+        if (tables == NULL) {
+            fprintf(stderr, "Keeping the tables in use\n");
+            continue;
+        }
+        const lookup_tables *previous = atomic_exchange(&active_tables, tables);
+        const unsigned long epoch = atomic_fetch_add(&tables_epoch, 1) + 1;
+        if (previous != &builtin_tables) {
+            retired_tables *retired = malloc(sizeof(*retired));
+            if (retired == NULL) {
+                // Never released, rather than possibly still in use
+                fprintf(stderr, "Out of memory\n");
+            }
+            else {
+                retired->tables = (lookup_tables *) previous;
+                retired->epoch = epoch;
+                pthread_mutex_lock(&retired_lock);
+                retired->next = retired_list;
+                retired_list = retired;
+                pthread_cond_signal(&retired_added);
+                pthread_mutex_unlock(&retired_lock);
+            }
+        }
+        fprintf(stderr, "Reloaded tables from %s\n", path);
+    }
+    return NULL;
+}
+
+/**
+ * Start a thread reloading tables on SIGHUP, and one releasing replaced
+ * tables.
+ *
+ * SIGHUP is blocked in the calling thread, and so in any thread it creates
+ * later, leaving it to the reloader thread.
+ *
+ * @param path Name of the compiled table file
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+start_tables_reloader(const char *path)
+{
+    sigset_t signals;
+    pthread_t thread;
+    pthread_t reclaimer;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    if ((pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
+        || (pthread_create(&reclaimer, NULL, tables_reclaimer_main, NULL) != 0)
+        || (pthread_create(&thread, NULL, tables_reloader_main, (void *) path) != 0)) {
+        fprintf(stderr, "Could not start table reloading\n");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(reclaimer);
+    pthread_detach(thread);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Output the tables in use as a table specification.
+ */
+void
+dump_tables(out_buffer *out)
+{
+    char scratch[FIELD_SCRATCH_SIZE];
+    // Output all entries from the same tables, holding on to them
+    tables_pin();
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        for (uint32_t index = 0; index < reader_tables()->counts[table]; ++index) {
+            out_puts(out, table_infos[table].name);
+            out_putc(out, ' ');
+            out_puts(out, hex_str(index, scratch));
+            out_putc(out, ' ');
+            if (table_infos[table].strings) {
+                out_puts(out, table_str((table_id) table, index, 0, NULL));
+            }
+            else if (table == TABLE_MEMORY) {
+                out_puts(out, decimal_str(table_value((table_id) table, index, 0),
+                                          scratch));
+            }
+            else {
+                out_puts(out, hex_str(table_value((table_id) table, index, 0),
+                                      scratch));
+            }
+            out_putc(out, '\n');
+        }
+    }
+    tables_unpin();
+}
+
+#ifdef __linux__
+/*
+ * Shared memory ring interface, for local processes decoding codes at high
+ * rates.
+ *
+ * A worker (--ring-serve NAME) creates the POSIX shared memory object NAME,
+ * holding RING_CHANNELS channels. A producer claims a free channel (or one
+ * whose owner has died) by setting its owner to its process id, then
+ * enqueues codes in the channel's request ring, and the worker puts a
+ * decoded ring_response for each in the channel's response ring, in
+ * order. Each ring has a single producer
+ * and a single consumer, so they need no locks, and several producers use
+ * the worker through separate channels.
+ *
+ * Indexes run freely and are reduced modulo RING_ENTRIES. A consumer that
+ * finds a ring empty (or a producer that finds it full) spins for a while,
+ * and only then sleeps on a futex, after flagging that it is waiting. The
+ * other side only makes the futex system call when it sees that flag, so
+ * there are no system calls while rings are busy. The worker sleeps on a
+ * single doorbell for all channels.
+ */
+#define RING_MAGIC      0x56524950      // "PIRV"
+#define RING_VERSION    2
+#define RING_CHANNELS   8
+#define RING_ENTRIES    1024            // Power of two
+#define RING_SPINS      2000            // Polls before sleeping
+
+/*
+ * Decoded record of a code, as returned in the response ring.
+ */
+typedef struct {
+    uint32_t code;              // The code as requested
+    uint32_t reserved;
+    revision_descriptor descriptor;
+} ring_response;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head;     // Next entry to write
+    _Atomic uint32_t consumer_waiting;      // Set while sleeping on head
+    _Alignas(64) _Atomic uint32_t tail;     // Next entry to read
+    _Atomic uint32_t producer_waiting;      // Set while sleeping on tail
+} ring_indexes;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t owner;    // Producer process id, 0 if free
+    ring_indexes requests;
+    ring_indexes responses;
+    revcode_32 request_codes[RING_ENTRIES];
+    ring_response response_records[RING_ENTRIES];
+} ring_channel;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t channel_count;
+    uint32_t entry_count;
+    _Alignas(64) _Atomic uint32_t worker_waiting;   // Set while sleeping
+    _Atomic uint32_t doorbell;                      // Bumped to wake worker
+    ring_channel channels[RING_CHANNELS];
+} ring_shared;
+
+volatile sig_atomic_t ring_stop;
+
+void
+ring_stop_handler(const int signal_number)
+{
+    (void) signal_number;
+    ring_stop = 1;
+}
+
+/**
+ * Sleep until a (shared) futex word no longer holds a value, a wakeup or
+ * a timeout.
+ */
+void
+futex_wait(_Atomic uint32_t *word, const uint32_t value)
+{
+    const struct timespec timeout = { 1, 0 };
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+void
+futex_wake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Wait until a ring index differs from a value: spin first, then sleep.
+ *
+ * @param index The index (head to wait for data, tail to wait for space)
+ * @param waiting Flag to set while sleeping
+ * @param value The value to wait to change
+ */
+void
+ring_wait(_Atomic uint32_t *index, _Atomic uint32_t *waiting, const uint32_t value)
+{
+    for (int spin = 0; spin < RING_SPINS; ++spin) {
+        if (atomic_load_explicit(index, memory_order_acquire) != value) {
+            return;
+        }
+    }
+    atomic_store(waiting, 1);
+    if (atomic_load(index) == value) {
+        futex_wait(index, value);
+    }
+    atomic_store(waiting, 0);
+}
+
+/**
+ * Publish a new ring index, waking the other side if it is sleeping on it.
+ */
+void
+ring_publish(_Atomic uint32_t *index, _Atomic uint32_t *waiting, const uint32_t value)
+{
+    atomic_store(index, value);
+    if (atomic_load(waiting)) {
+        futex_wake(index);
+    }
+}
+
+void
+ring_ring_doorbell(ring_shared *shared)
+{
+    if (atomic_load(&shared->worker_waiting)) {
+        atomic_fetch_add(&shared->doorbell, 1);
+        futex_wake(&shared->doorbell);
+    }
+}
+
+void
+ring_decode(const revcode_32 code, ring_response *response)
+{
+    response->code = code;
+    response->reserved = 0;
+    response->descriptor = describe_revision(code);
+}
+
+/**
+ * Map a ring shared memory object.
+ *
+ * @param name Name of the object, with or without leading '/'
+ * @param create If set, (re)create the object
+ * @returns The mapping, or NULL on failure
+ */
+ring_shared *
+ring_open(const char *name, const int create)
+{
+    char shm_name[NAME_MAX];
+    snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/') ? "" : "/", name);
+    if (create) {
+        shm_unlink(shm_name);
+    }
+    const int fd = shm_open(shm_name, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR,
+                            0600);
+    if ((fd < 0) || (create && (ftruncate(fd, sizeof(ring_shared)) != 0))) {
+        fprintf(stderr, "Could not open shared memory %s\n", shm_name);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size == (off_t) sizeof(ring_shared))) {
+        data = mmap(NULL, sizeof(ring_shared), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: not a pirevision ring\n", shm_name);
+        return NULL;
+    }
+    ring_shared *shared = data;
+    if (create) {
+        shared->magic = RING_MAGIC;
+        shared->version = RING_VERSION;
+        shared->channel_count = RING_CHANNELS;
+        shared->entry_count = RING_ENTRIES;
+    }
+    else if ((shared->magic != RING_MAGIC) || (shared->version != RING_VERSION)) {
+        fprintf(stderr, "%s: not a pirevision ring\n", shm_name);
+        munmap(data, sizeof(ring_shared));
+        return NULL;
+    }
+    return shared;
+}
+
+/**
+ * Serve decode requests from a shared memory ring until interrupted.
+ *
+ * @param name Name of the shared memory object to create
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+ring_serve(const char *name)
+{
+    ring_shared *shared = ring_open(name, 1);
+    if (shared == NULL) {
+        return EXIT_FAILURE;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = ring_stop_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    unsigned long idle = 0;
+    while (!ring_stop) {
+        int busy = 0;
+        for (int index = 0; index < RING_CHANNELS; ++index) {
+            ring_channel *channel = &shared->channels[index];
+            const uint32_t request_head = atomic_load_explicit(&channel->requests.head,
+                                                               memory_order_acquire);
+            uint32_t request_tail = atomic_load_explicit(&channel->requests.tail,
+                                                         memory_order_relaxed);
+            const uint32_t response_tail = atomic_load_explicit(&channel->responses.tail,
+                                                                memory_order_acquire);
+            uint32_t response_head = atomic_load_explicit(&channel->responses.head,
+                                                          memory_order_relaxed);
+            if ((request_head == request_tail)
+                || (response_head - response_tail == RING_ENTRIES)) {
+                continue;
+            }
+            // Decode as many requests as there is room for responses
+            while ((request_tail != request_head)
+                   && (response_head - response_tail != RING_ENTRIES)) {
+                ring_decode(channel->request_codes[request_tail % RING_ENTRIES],
+                            &channel->response_records[response_head % RING_ENTRIES]);
+                ++request_tail;
+                ++response_head;
+            }
+            ring_publish(&channel->requests.tail, &channel->requests.producer_waiting,
+                         request_tail);
+            ring_publish(&channel->responses.head, &channel->responses.consumer_waiting,
+                         response_head);
+            busy = 1;
+        }
+        if (busy) {
+            // No table lookups are in progress between passes, so let
+            // tables be replaced even while requests keep coming
+            tables_resume(tables_pause());
+            idle = 0;
+            continue;
+        }
+        if (++idle < RING_SPINS) {
+            continue;
+        }
+
+        // Nothing to do: sleep until a producer rings the doorbell
+        const int paused = tables_pause();
+        atomic_store(&shared->worker_waiting, 1);
+        const uint32_t doorbell = atomic_load(&shared->doorbell);
+        int pending = 0;
+        for (int index = 0; index < RING_CHANNELS; ++index) {
+            ring_channel *channel = &shared->channels[index];
+            pending |= (atomic_load(&channel->requests.head)
+                        != atomic_load(&channel->requests.tail))
+                       && (atomic_load(&channel->responses.head)
+                           - atomic_load(&channel->responses.tail) != RING_ENTRIES);
+        }
+        if (!pending) {
+            futex_wait(&shared->doorbell, doorbell);
+        }
+        atomic_store(&shared->worker_waiting, 0);
+        tables_resume(paused);
+        idle = 0;
+    }
+
+    char shm_name[NAME_MAX];
+    snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/') ? "" : "/", name);
+    shm_unlink(shm_name);
+    munmap(shared, sizeof(ring_shared));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Take the available responses from a channel and output them.
+ *
+ * @returns Number of responses taken
+ */
+uint32_t
+ring_take_responses(ring_shared *shared,
+                    ring_channel *channel,
+                    revision_output *output,
+                    int *exit_status)
+{
+    const uint32_t head = atomic_load_explicit(&channel->responses.head,
+                                               memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&channel->responses.tail,
+                                         memory_order_relaxed);
+    const uint32_t taken = head - tail;
+    char scratch[FIELD_SCRATCH_SIZE];
+    for (; tail != head; ++tail) {
+        const ring_response *response = &channel->response_records[tail % RING_ENTRIES];
+        if (descriptor_error(response->descriptor) == DESCRIPTOR_INVALID) {
+            fprintf(stderr, "Invalid revision code %s\n",
+                    hex_str(response->code, scratch));
+            *exit_status = EXIT_FAILURE;
+            continue;
+        }
+        const revision_record record = {
+            response->code, descriptor_code(response->descriptor), 1, NULL, NULL
+        };
+        emit_record(output, &record);
+    }
+    if (taken > 0) {
+        ring_publish(&channel->responses.tail, &channel->responses.producer_waiting,
+                     tail);
+        ring_ring_doorbell(shared);
+    }
+    return taken;
+}
+
+/**
+ * Claim a channel that is free, or whose owner has exited without releasing
+ * it, and discard anything a previous owner left in its rings.
+ *
+ * The worker advances the request tail and response head itself, so they
+ * are not reset: instead, responses are dropped until the worker has
+ * answered every request, which leaves both rings empty.
+ *
+ * @returns The channel, or NULL if all are in use
+ */
+ring_channel *
+ring_claim_channel(ring_shared *shared)
+{
+    for (int index = 0; index < RING_CHANNELS; ++index) {
+        ring_channel *channel = &shared->channels[index];
+        uint32_t owner = atomic_load(&channel->owner);
+        if ((owner != 0) && ((kill((pid_t) owner, 0) == 0) || (errno != ESRCH))) {
+            continue;
+        }
+        if (!atomic_compare_exchange_strong(&channel->owner, &owner,
+                                            (uint32_t) getpid())) {
+            continue;
+        }
+        atomic_store(&channel->requests.producer_waiting, 0);
+        atomic_store(&channel->responses.consumer_waiting, 0);
+        for (;;) {
+            const uint32_t requested = atomic_load(&channel->requests.head);
+            const uint32_t answered = atomic_load(&channel->responses.head);
+            ring_publish(&channel->responses.tail, &channel->responses.producer_waiting,
+                         answered);
+            if (answered == requested) {
+                break;
+            }
+            ring_ring_doorbell(shared);
+            ring_wait(&channel->responses.head, &channel->responses.consumer_waiting,
+                      answered);
+        }
+        return channel;
+    }
+    return NULL;
+}
+
+/**
+ * Decode codes through a worker serving a shared memory ring, as an example
+ * producer. Codes are taken from the arguments, or lines of standard input
+ * if there are none.
+ *
+ * @param name Name of the shared memory object of the worker
+ * @param codes Codes to decode
+ * @param code_count Number of codes
+ * @param output Destination of the decoded codes
+ * @returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int
+ring_client(const char *name,
+            const char **codes,
+            const int code_count,
+            revision_output *output)
+{
+    ring_shared *shared = ring_open(name, 0);
+    if (shared == NULL) {
+        return EXIT_FAILURE;
+    }
+    ring_channel *channel = ring_claim_channel(shared);
+    if (channel == NULL) {
+        fprintf(stderr, "No free ring channel\n");
+        munmap(shared, sizeof(ring_shared));
+        return EXIT_FAILURE;
+    }
+
+    line_reader reader;
+    if ((code_count == 0) && (line_reader_open(&reader, "-") != EXIT_SUCCESS)) {
+        atomic_store(&channel->owner, 0);
+        munmap(shared, sizeof(ring_shared));
+        return EXIT_FAILURE;
+    }
+    int exit_status = EXIT_SUCCESS;
+    int next_code = 0;
+    int input_done = 0;
+    unsigned long outstanding = 0;
+    while (!input_done || (outstanding > 0)) {
+        // Enqueue codes while there is room
+        uint32_t head = atomic_load_explicit(&channel->requests.head,
+                                             memory_order_relaxed);
+        const uint32_t tail = atomic_load_explicit(&channel->requests.tail,
+                                                   memory_order_acquire);
+        const uint32_t first = head;
+        while (!input_done && (head - tail != RING_ENTRIES)) {
+            const char *code;
+            size_t length;
+            if (code_count > 0) {
+                code = (next_code < code_count) ? codes[next_code++] : NULL;
+            }
+            else {
+                code = line_reader_next(&reader, &length);
+            }
+            if (code == NULL) {
+                input_done = 1;
+                break;
+            }
+            code += strspn(code, " \t");
+            length = strcspn(code, " \t");
+            revcode_32 value;
+            if (parse_revision(code, length, 16, &value) != EXIT_SUCCESS) {
+                if (length > 0) {
+                    fprintf(stderr, "Invalid revision code \"%s\"\n", code);
+                    exit_status = EXIT_FAILURE;
+                }
+                continue;
+            }
+            channel->request_codes[head++ % RING_ENTRIES] = value;
+        }
+        if (head != first) {
+            ring_publish(&channel->requests.head, &channel->requests.consumer_waiting,
+                         head);
+            ring_ring_doorbell(shared);
+            outstanding += head - first;
+        }
+
+        const uint32_t taken = ring_take_responses(shared, channel, output,
+                                                   &exit_status);
+        outstanding -= taken;
+        if ((taken == 0) && (outstanding > 0)
+            && (input_done || (head - tail == RING_ENTRIES))) {
+            ring_wait(&channel->responses.head, &channel->responses.consumer_waiting,
+                      atomic_load(&channel->responses.tail));
+        }
+    }
+    if (code_count == 0) {
+        if (reader.failed) {
+            exit_status = EXIT_FAILURE;
+        }
+        line_reader_close(&reader);
+    }
+    atomic_store(&channel->owner, 0);
+    munmap(shared, sizeof(ring_shared));
+    return output->out->failed ? EXIT_FAILURE : exit_status;
+}
+#endif
+
+void
+print_usage(void)
+{
+    fputs("Usage: pirevision [-j|--json] [--fields list] [--format template]\n"
+          "                  [--files-from file] [revision code|cpuinfo file|@list...]\n"
+          "       pirevision [output options] --binary-input le|be [file...]\n"
+          "       pirevision [--fields list] --enrich-ndjson key [file...]\n"
+          "       pirevision [--fields list] --enrich-csv column [file...]\n"
+          "       pirevision [-j|--csv] --window seconds [file...]\n"
+          "       pirevision --index file --upsert [delta file...]\n"
+          "       pirevision [output options] --index file --lookup host...\n"
+          "       pirevision [output options] --index file --query constraints\n"
+          "       pirevision --bitmap-index file [file...]\n"
+          "       pirevision [--bitmap-index file] --bitmap-query query [file...]\n"
+          "       pirevision [-j] [--fields list] --diff old new\n"
+          "       pirevision [output options] --match constraints\n"
+          "       pirevision --compile-tables spec file\n"
+          "       pirevision --dump-tables\n"
+          "       pirevision [output options] --tar [archive...]\n"
+          "       pirevision --ring-serve name\n"
+          "       pirevision [output options] --ring-client name [code...]\n", stderr);
+    fputs("\n"
+          "  -j, --json      Output JSON instead of text\n"
+          "  --csv           Output CSV instead of text\n"
+          "  --binary-output Output binary records instead of text\n"
+          "  --descriptor-output\n"
+          "                  Output 64-bit packed descriptors instead of text\n"
+          "  --collapse-runs Output consecutive identical codes once, with count\n"
+          "  --sort-by list  Output records sorted by the comma separated fields\n"
+          "  --sort-memory mb\n"
+          "                  Memory for sorting before spilling to temporary files\n"
+          "  --group-headers Output a header line before each group of sorted records\n"
+          "  --output format=path\n"
+          "                  Output to path (- for standard output) instead, in\n"
+          "                  format: text, json, csv, binary or descriptor\n"
+          "                  (repeatable)\n"
+          "  --gzip-output   Compress output with gzip\n"
+          "  --partition template\n"
+          "                  Output records to files with paths given by the template,\n"
+          "                  e.g. \"fleet/{type}-{memory}.txt\"\n"
+          "  --max-open n    Maximum number of partition files kept open\n"
+          "  --fields list   Comma separated fields to output, in order\n"
+          "  --format template\n"
+          "                  Output one line per code as given by the template,\n"
+          "                  e.g. \"{code:x} {type} {memory_mb}\"\n", stderr);
+    fputs("  --binary-input le|be\n"
+          "                  Read raw 32-bit codes of the given byte order from\n"
+          "                  the files (or standard input) instead\n"
+          "  --enrich-ndjson key\n"
+          "                  Copy NDJSON records from the files (or standard\n"
+          "                  input), adding the decoded code found under key\n"
+          "  --enrich-csv column\n"
+          "                  Copy CSV tables from the files (or standard input),\n"
+          "                  appending columns decoding the code in the named\n"
+          "                  (or numbered, from 1) column\n"
+          "  --window seconds\n"
+          "                  Count \"timestamp code\" lines from the files (or\n"
+          "                  standard input) per model in windows of seconds\n", stderr);
+    fputs("  --index file    Fleet inventory index file, used with:\n"
+          "  --upsert        Apply \"host code\" lines from the files (or standard\n"
+          "                  input) to the index; a code of - removes the host\n"
+          "  --lookup        Output the records of the hosts\n"
+          "  --query constraints\n"
+          "                  Output the records of all hosts matching all\n"
+          "                  constraints, e.g. \"type=4B,memory=4GB\"\n"
+          "  --bitmap-index file\n"
+          "                  Save bitmap indexes of the lines of codes in the\n"
+          "                  files (or standard input) to file, for queries\n"
+          "  --bitmap-query query\n"
+          "                  Output the numbers (from 0) of the lines of codes\n"
+          "                  matching the query, e.g.\n"
+          "                  \"memory=4GB&processor=BCM2711|type=5\", using the\n"
+          "                  --bitmap-index file, else indexing the files first\n"
+          "  --diff old new  Compare two files (- for standard input) of \"host code\"\n"
+          "                  lines, listing added, removed and changed hosts\n"
+          "  --match constraints\n"
+          "                  Output all valid codes matching the constraints,\n"
+          "                  e.g. \"type=4B,memory>=2GB,manufacturer=Sony UK\"\n",
+          stderr);
+    fputs("  --tables file   Use the lookup tables compiled into file, instead of\n"
+          "                  the built-in ones (default: $PIREVISION_TABLES),\n"
+          "                  reloading them on SIGHUP\n"
+          "  --compile-tables spec file\n"
+          "                  Compile the table specification spec, applied to\n"
+          "                  the tables in use, into file\n"
+          "  --dump-tables   Output the tables in use as a table specification\n"
+          "  --ring-serve name\n"
+          "                  Decode codes for local processes through the shared\n"
+          "                  memory rings name (Linux only)\n"
+          "  --ring-client name\n"
+          "                  Decode the codes (or lines of standard input) through\n"
+          "                  the worker serving the shared memory rings name\n"
+          "  --async-output  Write output from a separate thread, overlapping\n"
+          "                  decoding and writing\n"
+          "  --splice-output When output is a pipe, hand output buffers to the\n"
+          "                  kernel with vmsplice() instead of copying them\n"
+          "  --files-from file\n"
+          "                  Process each cpuinfo file listed in file (- for\n"
+          "                  standard input)\n", stderr);
+    fputs("\n"
+          "Arguments that are not hexadecimal codes are cpuinfo files, @file\n"
+          "arguments name files listing further codes or cpuinfo files, one\n"
+          "per line.\n"
+          "\n"
+          "Fields: ", stderr);
+    for (size_t index = 0; index < ARRAY_CNT(field_table); ++index) {
+        fprintf(stderr, "%s%s", (index > 0) ? "," : "", field_table[index].id);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Match an option taking an argument, given as "name value" or "name=value".
+ *
+ * @param name The option name, e.g. "--fields"
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @param index Index of the argument being parsed, advanced past a
+ *              separate option argument
+ * @returns The option argument, or NULL if the argument is not this option
+ */
+const char *
+option_argument(const char *name,
+                const int argc,
+                const char *argv[],
+                int *index)
+{
+    const char *arg = argv[*index];
+    const size_t name_length = strlen(name);
+    if (strncmp(arg, name, name_length) != 0) {
+        return NULL;
+    }
+    if (arg[name_length] == '=') {
+        return &arg[name_length + 1];
+    }
+    if (arg[name_length] != '\0') {
+        return NULL;
+    }
+    if (*index + 1 >= argc) {
+        fprintf(stderr, "Option %s requires an argument\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return argv[++(*index)];
+}
+
+/**
+ * Usage: pirevision [-j|--json] [--fields list] [--format template]
+ *                   [--files-from file]
+ *                   [revision code|cpuinfo file|@list file...]
+ *
+ * -j flag causes JSON output instead of text
+ * --csv and --binary-output cause CSV or binary output (three little endian
+ * 32-bit values per record: code, normalized code and count) instead.
+ * --descriptor-output outputs the packed descriptor of each record (see
+ * revision_descriptor) as a little endian 64-bit value instead.
+ * --collapse-runs outputs a run of consecutive identical codes as a single
+ * record with a count.
+ * --sort-by outputs the records sorted by a comma separated list of fields
+ * (and then by code), using at most --sort-memory MB before spilling sorted
+ * runs to temporary files. --group-headers outputs a header line before
+ * each group of records with the same sort fields.
+ * --output format=path, which can be given several times, outputs the
+ * records in each format given to the respective file (decoding each code
+ * once), instead of to standard output unless a path is -.
+ * Input compressed with gzip is decompressed, and --gzip-output compresses
+ * the output, if built with zlib (see input_open()).
+ * --tar makes the arguments tar archives (standard input if none, or "-")
+ * of cpuinfo files, outputting a record named by its path per member.
+ * --partition outputs each record to the file with the path given by a
+ * template over its fields (see compile_template()), keeping at most
+ * --max-open files open.
+ * --fields selects the fields to output, and their order, as a comma
+ * separated list of field ids (e.g. "type,memory"). Fields not selected
+ * are not decoded at all.
+ * --format outputs a line per code according to a template referencing
+ * fields, such as "{code:x} {type} {memory_mb}" (see compile_template()).
+ * --binary-input le|be makes the arguments files (standard input if none,
+ * or "-") holding raw 32-bit codes in little or big endian byte order.
+ * --enrich-ndjson key makes the arguments NDJSON files (standard input if
+ * none, or "-") which are copied to the output, adding a "decoded" member
+ * to each object with a revision code under the given key.
+ * --enrich-csv column makes the arguments CSV files (standard input if none,
+ * or "-") which are copied to the output, appending decoded columns (by
+ * default type, processor, memory, manufacturer, revision and flags). The
+ * column holding the code is given by name or number, starting at 1.
+ * --window seconds makes the arguments files (standard input if none, or
+ * "-") of "timestamp code" lines, which are counted per type, processor,
+ * memory and manufacturer in consecutive windows of the given duration.
+ * --index file names a fleet inventory index: with --upsert the arguments
+ * are files (standard input if none) of "host code" lines applied to it,
+ * with --lookup the arguments are hosts to output, and --query outputs all
+ * hosts matching constraints such as "type=4B,memory=4GB".
+ * --bitmap-index file saves compressed bitmap indexes of the lines of codes
+ * in the files (standard input if none) to file. --bitmap-query outputs the
+ * line numbers of codes matching a query, such as
+ * "memory=4GB&overvoltage=disallowed" ('&' binding tighter than '|'), using
+ * the bitmaps mapped from the --bitmap-index file, or else built from the
+ * files.
+ * --diff compares two snapshots of "host code" lines, outputting added,
+ * removed and changed hosts, with the fields that changed.
+ * --match outputs all valid codes matching constraints such as
+ * "type=4B,memory>=2GB".
+ * --tables (or $PIREVISION_TABLES) names compiled lookup tables to use
+ * instead of the built-in ones, --compile-tables compiles a table
+ * specification and --dump-tables outputs one for the tables in use.
+ * --ring-serve decodes codes from local processes through shared memory
+ * rings, and --ring-client decodes codes through such a worker.
+ * If no revision code(s) supplied, attempt to get it from /proc/cpuinfo and
+ * use that, if succesful. Otherwise process each argument as a separate
+ * revision code. These must be specified as hexadecimal codes, with, or without
+ * 0x or 0X prefix. Other arguments are instead taken as cpuinfo
+ * files to extract a code from, and arguments of the form @file name a file
+ * holding one such code or cpuinfo file per line. --files-from names a file
+ * listing one cpuinfo file per line.
+ * --async-output writes the output from a separate thread.
+ * --splice-output splices output into a pipe with vmsplice(), where supported.
+ */
+int
+main(const int argc, const char *argv[])
+{
+    output_spec spec;
+    revision_output output;
+    const char *field_list = NULL;
+    const char *template = NULL;
+    const char *binary_input = NULL;
+    const char *files_from = NULL;
+    const char *ndjson_key = NULL;
+    const char *csv_column = NULL;
+    long window_width = 0;
+    const char *index_path = NULL;
+    const char *index_query_text = NULL;
+    int index_upsert_mode = 0;
+    int index_lookup_mode = 0;
+    const char *bitmap_query_text = NULL;
+    const char *bitmap_index_path = NULL;
+    const char *diff_paths[2] = { NULL, NULL };
+    const char *match_text = NULL;
+    const char *tables_path = getenv("PIREVISION_TABLES");
+    const char *compile_paths[2] = { NULL, NULL };
+    int dump_tables_mode = 0;
+    const char *ring_serve_name = NULL;
+    const char *ring_client_name = NULL;
+    const char *sort_list = NULL;
+    unsigned long sort_memory = SORT_DEFAULT_MEMORY;
+    record_sorter sorter;
+    const char *partition_template = NULL;
+    long max_open = PARTITION_DEFAULT_OPEN;
+    partition_writer partitions;
+    const char *sink_arguments[MAX_OUTPUT_SINKS];
+    int sink_count = 0;
+    output_sinks sinks;
+    int async_output = 0;
+    int splice_output = 0;
+    int gzip_output_mode = 0;
+    int tar_mode = 0;
+    int first_code_index = 1;
+
+    // Buffered output must also reach stdout when exiting on invalid input
+    atexit(flush_stdout_buffer);
+
+    spec.format = FORMAT_TEXT;
+    spec.collapse_runs = 0;
+    spec.group_headers = 0;
+    for (; first_code_index < argc; ++first_code_index) {
+        const char *arg = argv[first_code_index];
+        const char *value;
+        if ((arg[0] != '-') || (arg[1] == '\0')) {
+            break;
+        }
+        if (strcmp(arg, "--") == 0) {
+            ++first_code_index;
+            break;
+        }
+        if ((strcmp(arg, "-j") == 0) || (strcmp(arg, "--json") == 0)) {
+            spec.format = FORMAT_JSON;
+        }
+        else if (strcmp(arg, "--csv") == 0) {
+            spec.format = FORMAT_CSV;
+        }
+        else if (strcmp(arg, "--binary-output") == 0) {
+            spec.format = FORMAT_BINARY;
+        }
+        else if (strcmp(arg, "--descriptor-output") == 0) {
+            spec.format = FORMAT_DESCRIPTOR;
+        }
+        else if (strcmp(arg, "--collapse-runs") == 0) {
+            spec.collapse_runs = 1;
+        }
+        else if ((value = option_argument("--sort-by",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            sort_list = value;
+        }
+        else if ((value = option_argument("--sort-memory",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            char *end;
+            sort_memory = strtoul(value, &end, 10);
+            if ((*end != '\0') || (sort_memory == 0)) {
+                fprintf(stderr, "Invalid sort memory \"%s\"\n", value);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(arg, "--tar") == 0) {
+            tar_mode = 1;
+        }
+        else if (strcmp(arg, "--gzip-output") == 0) {
+            gzip_output_mode = 1;
+        }
+        else if (strcmp(arg, "--group-headers") == 0) {
+            spec.group_headers = 1;
+        }
+        else if ((value = option_argument("--output",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            if (sink_count == MAX_OUTPUT_SINKS) {
+                fprintf(stderr, "Too many outputs\n");
+                return EXIT_FAILURE;
+            }
+            sink_arguments[sink_count++] = value;
+        }
+        else if ((value = option_argument("--partition",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            partition_template = value;
+        }
+        else if ((value = option_argument("--max-open",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            char *end;
+            max_open = strtol(value, &end, 10);
+            if ((*end != '\0') || (max_open <= 0) || (max_open > INT_MAX)) {
+                fprintf(stderr, "Invalid number of open files \"%s\"\n", value);
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((value = option_argument("--fields",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            field_list = value;
+        }
+        else if ((value = option_argument("--format",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            template = value;
+        }
+        else if ((value = option_argument("--binary-input",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            if ((strcmp(value, "le") != 0) && (strcmp(value, "be") != 0)) {
+                fprintf(stderr, "Byte order must be le or be\n");
+                return EXIT_FAILURE;
+            }
+            binary_input = value;
+        }
+        else if ((value = option_argument("--files-from",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            files_from = value;
+        }
+        else if ((value = option_argument("--enrich-ndjson",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            ndjson_key = value;
+        }
+        else if ((value = option_argument("--enrich-csv",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            csv_column = value;
+        }
+        else if ((value = option_argument("--window",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            char *end;
+            window_width = strtol(value, &end, 10);
+            if ((*end != '\0') || (window_width <= 0)) {
+                fprintf(stderr, "Invalid window width \"%s\"\n", value);
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((value = option_argument("--index",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            index_path = value;
+        }
+        else if ((value = option_argument("--query",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            index_query_text = value;
+        }
+        else if ((value = option_argument("--bitmap-query",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            bitmap_query_text = value;
+        }
+        else if ((value = option_argument("--bitmap-index",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            bitmap_index_path = value;
+        }
+        else if ((value = option_argument("--match",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            match_text = value;
+        }
+        else if ((value = option_argument("--tables",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            tables_path = value;
+        }
+        else if (strcmp(arg, "--compile-tables") == 0) {
+            if (first_code_index + 2 >= argc) {
+                fprintf(stderr, "--compile-tables requires two files\n");
+                return EXIT_FAILURE;
+            }
+            compile_paths[0] = argv[++first_code_index];
+            compile_paths[1] = argv[++first_code_index];
+        }
+        else if ((value = option_argument("--ring-serve",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            ring_serve_name = value;
+        }
+        else if ((value = option_argument("--ring-client",
+                                          argc, argv,
+                                          &first_code_index)) != NULL) {
+            ring_client_name = value;
+        }
+        else if (strcmp(arg, "--dump-tables") == 0) {
+            dump_tables_mode = 1;
+        }
+        else if (strcmp(arg, "--diff") == 0) {
+            if (first_code_index + 2 >= argc) {
+                fprintf(stderr, "--diff requires two files\n");
+                return EXIT_FAILURE;
+            }
+            diff_paths[0] = argv[++first_code_index];
+            diff_paths[1] = argv[++first_code_index];
+            if ((strcmp(diff_paths[0], "-") == 0)
+                && (strcmp(diff_paths[1], "-") == 0)) {
+                fprintf(stderr, "--diff can read only one file from standard input\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(arg, "--upsert") == 0) {
+            index_upsert_mode = 1;
+        }
+        else if (strcmp(arg, "--lookup") == 0) {
+            index_lookup_mode = 1;
+        }
+        else if (strcmp(arg, "--async-output") == 0) {
+            async_output = 1;
+        }
+        else if (strcmp(arg, "--splice-output") == 0) {
+            splice_output = 1;
+        }
+        else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0)) {
+            print_usage();
+            return EXIT_SUCCESS;
+        }
+        else {
+            fprintf(stderr, "Unknown option \"%s\"\n", arg);
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((tables_path != NULL) && (*tables_path != '\0')) {
+        const lookup_tables *tables = load_tables(tables_path);
+        if (tables != NULL) {
+            atomic_store(&active_tables, tables);
+        }
+        else {
+            fprintf(stderr, "Using built-in tables\n");
+        }
+        if (start_tables_reloader(tables_path) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+    tables_online();
+
+    if (template != NULL) {
+        if ((field_list != NULL) || (spec.format != FORMAT_TEXT)) {
+            fprintf(stderr,
+                    "--format cannot be combined with other output formats"
+                    " or --fields\n");
+            return EXIT_FAILURE;
+        }
+        if (compile_template(template, &spec.program) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        spec.format = FORMAT_TEMPLATE;
+    }
+    else if (field_list != NULL) {
+        if (parse_field_list(field_list, &spec.selection) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (csv_column != NULL) {
+        parse_field_list("type,processor,memory,manufacturer,revision,flags",
+                         &spec.selection);
+    }
+    else if ((index_path != NULL) || tar_mode) {
+        // Records from the index or archives are identified by host or path
+        select_default_fields(&spec.selection, 1);
+        memmove(&spec.selection.fields[1], &spec.selection.fields[0],
+                sizeof(spec.selection.fields[0]) * (size_t) spec.selection.count);
+        spec.selection.fields[0] = find_field("name", 4);
+        spec.selection.count++;
+    }
+    else {
+        select_default_fields(&spec.selection,
+                              (spec.format == FORMAT_JSON)
+                              || (spec.format == FORMAT_CSV)
+                              || (ndjson_key != NULL));
+    }
+    if (spec.collapse_runs) {
+        // Make sure run lengths are output
+        select_count_field(&spec.selection);
+    }
+    revision_output_init(&output, &stdout_buffer, &spec);
+    if (((sort_list != NULL) || (partition_template != NULL) || (sink_count > 0))
+        && ((compile_paths[0] != NULL) || dump_tables_mode
+            || (ring_serve_name != NULL) || (ring_client_name != NULL)
+            || (index_path != NULL) || (match_text != NULL)
+            || (diff_paths[0] != NULL) || (bitmap_query_text != NULL)
+            || (bitmap_index_path != NULL) || (window_width > 0)
+            || (csv_column != NULL) || (ndjson_key != NULL) || tar_mode)) {
+        fprintf(stderr,
+                "--sort-by, --partition and --output only apply to decoding codes"
+                " and files\n");
+        return EXIT_FAILURE;
+    }
+    if ((window_width > 0)
+        && (((spec.format != FORMAT_TEXT) && (spec.format != FORMAT_JSON)
+             && (spec.format != FORMAT_CSV))
+            || (field_list != NULL) || spec.collapse_runs || (binary_input != NULL))) {
+        fprintf(stderr,
+                "--window only outputs text, JSON or CSV, and cannot be combined"
+                " with --fields, --collapse-runs or --binary-input\n");
+        return EXIT_FAILURE;
+    }
+    if (sort_list != NULL) {
+        if (record_sorter_init(&sorter, sort_list, sort_memory) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        output.sorter = &sorter;
+    }
+    if (partition_template != NULL) {
+        if (partition_writer_init(&partitions, partition_template,
+                                  (int) max_open, &spec) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        output.partitions = &partitions;
+    }
+    if (sink_count > 0) {
+        if ((spec.format != FORMAT_TEXT) || (partition_template != NULL)
+            || spec.group_headers) {
+            fprintf(stderr,
+                    "--output cannot be combined with other output formats,"
+                    " --partition or --group-headers\n");
+            return EXIT_FAILURE;
+        }
+        sinks.count = 0;
+        for (int index = 0; index < sink_count; ++index) {
+            if (output_sink_open(&sinks.sinks[sinks.count], sink_arguments[index],
+                                 &spec, field_list != NULL) != EXIT_SUCCESS) {
+                output_sinks_finish(&sinks);
+                return EXIT_FAILURE;
+            }
+            sinks.count++;
+        }
+        output.sinks = &sinks;
+    }
+    if (spec.group_headers
+        && ((sort_list == NULL) || (partition_template != NULL)
+            || ((spec.format != FORMAT_TEXT) && (spec.format != FORMAT_TEMPLATE)))) {
+        fprintf(stderr,
+                "--group-headers requires --sort-by with text or --format output,"
+                " and no --partition\n");
+        return EXIT_FAILURE;
+    }
+
+    if (gzip_output_mode) {
+#ifdef PIREVISION_ZLIB
+        if (out_start_gzip(&stdout_buffer) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+#else
+        fprintf(stderr, "--gzip-output requires building with -DPIREVISION_ZLIB -lz\n");
+        return EXIT_FAILURE;
+#endif
+    }
+    if (splice_output && (out_start_splice(&stdout_buffer) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+    if (async_output && (out_start_async(&stdout_buffer) != EXIT_SUCCESS)) {
+        return EXIT_FAILURE;
+    }
+
+    if ((index_path != NULL)
+        != (index_upsert_mode || index_lookup_mode || (index_query_text != NULL))) {
+        fprintf(stderr, "--index requires one of --upsert, --lookup or --query\n");
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    if (compile_paths[0] != NULL) {
+        exit_status = compile_tables(compile_paths[0], compile_paths[1]);
+    }
+    else if (dump_tables_mode) {
+        dump_tables(output.out);
+    }
+    else if ((ring_serve_name != NULL) || (ring_client_name != NULL)) {
+#ifdef __linux__
+        exit_status = (ring_serve_name != NULL)
+                      ? ring_serve(ring_serve_name)
+                      : ring_client(ring_client_name,
+                                    &argv[first_code_index],
+                                    argc - first_code_index,
+                                    &output);
+#else
+        fprintf(stderr, "Shared memory rings are not supported on this system\n");
+        exit_status = EXIT_FAILURE;
+#endif
+    }
+    else if (index_upsert_mode) {
+        if (first_code_index >= argc) {
+            exit_status = index_upsert(index_path, "-");
+        }
+        for (int index = first_code_index;
+             (index < argc) && (exit_status == EXIT_SUCCESS); ++index) {
+            exit_status = index_upsert(index_path, argv[index]);
+        }
+    }
+    else if (index_lookup_mode) {
+        exit_status = index_lookup(index_path,
+                                   &argv[first_code_index],
+                                   argc - first_code_index,
+                                   &output);
+    }
+    else if (index_query_text != NULL) {
+        exit_status = index_query(index_path, index_query_text, &output);
+    }
+    else if (match_text != NULL) {
+        exit_status = process_match(match_text, &output);
+    }
+    else if (diff_paths[0] != NULL) {
+        exit_status = process_diff(diff_paths[0], diff_paths[1],
+                                   &spec, output.out);
+    }
+    else if (bitmap_query_text != NULL) {
+        if ((bitmap_index_path != NULL) && (first_code_index < argc)) {
+            fprintf(stderr, "--bitmap-query with --bitmap-index takes no files\n");
+            return EXIT_FAILURE;
+        }
+        exit_status = process_bitmap_query(bitmap_query_text,
+                                           bitmap_index_path,
+                                           &argv[first_code_index],
+                                           argc - first_code_index,
+                                           output.out);
+    }
+    else if (bitmap_index_path != NULL) {
+        exit_status = build_bitmap_index(bitmap_index_path,
+                                         &argv[first_code_index],
+                                         argc - first_code_index);
+    }
+    else if (window_width > 0) {
+        window_counts counts;
+        if (window_counts_init(&counts, window_width, spec.format) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (first_code_index >= argc) {
+            exit_status = process_window_file("-", &counts);
+        }
+        for (int index = first_code_index;
+             (index < argc) && (exit_status == EXIT_SUCCESS); ++index) {
+            exit_status = process_window_file(argv[index], &counts);
+        }
+        window_counts_emit(&counts);
+        window_counts_free(&counts);
+    }
+    else if (csv_column != NULL) {
+        if (first_code_index >= argc) {
+            exit_status = process_csv_file("-", csv_column, &spec);
+        }
+        for (int index = first_code_index;
+             (index < argc) && (exit_status == EXIT_SUCCESS); ++index) {
+            exit_status = process_csv_file(argv[index], csv_column, &spec);
+        }
+    }
+    else if (ndjson_key != NULL) {
+        if (first_code_index >= argc) {
+            exit_status = process_ndjson_file("-", ndjson_key, &spec);
+        }
+        for (int index = first_code_index;
+             (index < argc) && (exit_status == EXIT_SUCCESS); ++index) {
+            exit_status = process_ndjson_file(argv[index], ndjson_key, &spec);
+        }
+    }
+    else if (tar_mode) {
+        if (first_code_index >= argc) {
+            exit_status = process_tar_file("-", &output);
+        }
+        for (int index = first_code_index;
+             (index < argc) && (exit_status == EXIT_SUCCESS); ++index) {
+            exit_status = process_tar_file(argv[index], &output);
+        }
+    }
+    else if (binary_input != NULL) {
+        const int big_endian = strcmp(binary_input, "be") == 0;
+        if (first_code_index >= argc) {
+            exit_status = process_binary_file("-", big_endian, &output);
+        }
+        for (int index = first_code_index;
+             (index < argc) && (exit_status == EXIT_SUCCESS); ++index) {
+            exit_status = process_binary_file(argv[index], big_endian, &output);
+        }
+    }
+    // If no extra args, attempt to read from /proc/cpuinfo
+    else if ((first_code_index >= argc) && (files_from == NULL)) {
+        exit_status = process_proc_cpuinfo(&output);
+    }
+    else {
+        if (files_from != NULL) {
+            exit_status = process_list_file(files_from, 1, &output);
+        }
+        if (exit_status == EXIT_SUCCESS) {
+            exit_status = process_rev_codes(&argv[first_code_index],
+                                            argc - first_code_index,
+                                            &output);
+        }
+    }
+    if (output_finish(&output) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+    if (out_finish(&stdout_buffer) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+#ifdef PIREVISION_ZLIB
+    if (out_finish_gzip(&stdout_buffer) != EXIT_SUCCESS) {
+        exit_status = EXIT_FAILURE;
+    }
+#endif
+    return exit_status;
 }